@@ -0,0 +1,809 @@
+/*
+ * Micro benchmarks for the avl tree in avltree.h.
+ *
+ * Usage: avlbench [count]
+ *
+ * Build with -pthread. -DAVL_STATS adds rotation counters to the shape
+ * reports, -DNDEBUG skips the tree verification.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avltree.h"
+#include "avltree_latch.h"
+#include "pavltree.h"
+#include "sizepool.h"
+
+struct avlitem {
+    int i;
+    struct avl_node avl;
+};
+
+static inline int cmpint(const void *p1, const void *p2)
+{
+    int i1 = *(int *) p1;
+    int i2 = *(int *) p2;
+
+    return (i1 > i2) - (i1 < i2);
+}
+
+#include "avltree.c"
+
+static inline int avlitem_cmp(const struct avl_node *a,
+                              const struct avl_node *b)
+{
+    return cmpint(&avl_entry(a, struct avlitem, avl)->i,
+                  &avl_entry(b, struct avlitem, avl)->i);
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, size_t ops, double elapsed)
+{
+    printf("%-28s %10zu ops %9.3f ms %9.2f Mops/s\n", name, ops,
+           elapsed * 1e3, ops / elapsed * 1e-6);
+}
+
+static void avlitem_insert(struct avl_root *root, struct avlitem *new_entry)
+{
+    struct avl_node *parent = NULL;
+    struct avl_node **cur_nodep = &root->node;
+    struct avlitem *cur_entry;
+
+    while (*cur_nodep) {
+        cur_entry = avl_entry(*cur_nodep, struct avlitem, avl);
+
+        parent = *cur_nodep;
+        if (cmpint(&new_entry->i, &cur_entry->i) <= 0)
+            cur_nodep = &((*cur_nodep)->left);
+        else
+            cur_nodep = &((*cur_nodep)->right);
+    }
+
+    avl_insert(&new_entry->avl, parent, cur_nodep, root);
+}
+
+static void report_shape(const char *name, const struct avl_root *root)
+{
+    struct avl_stats stats;
+
+    avl_get_stats(root, &stats);
+    printf("%-28s %10zu nodes height %zu avg depth %.2f", name, stats.nodes,
+           stats.height,
+           stats.nodes ? (double) stats.total_depth / stats.nodes : 0.0);
+#ifdef AVL_STATS
+    printf(" rotations/insert %.3f",
+           stats.inserts ? (double) stats.rotations / stats.inserts : 0.0);
+#endif
+    printf("\n");
+}
+
+static void build_tree(struct avl_root *root, size_t count)
+{
+    INIT_AVL_ROOT(root);
+    for (size_t i = 0; i < count; i++) {
+        struct avlitem *item = malloc(sizeof(*item));
+        item->i = rand();
+        avlitem_insert(root, item);
+    }
+}
+
+static void bench_scan(size_t count)
+{
+    DEFINE_AVLROOT(root);
+    struct avlitem *item, *n;
+    struct avl_node *node;
+    volatile long sink;
+    long sum;
+    double t;
+    size_t visited;
+
+    build_tree(&root, count);
+    avl_assert_valid(&root, avlitem_cmp);
+    report_shape("random inserts", &root);
+
+    /* baseline: plain avl_next without prefetch */
+    t = now();
+    sum = 0;
+    for (node = avl_first(&root); node; node = avl_next(node))
+        sum += avl_entry(node, struct avlitem, avl)->i;
+    report("scan avl_next", count, now() - t);
+    sink = sum;
+
+    t = now();
+    sum = 0;
+    avl_for_each_entry (item, &root, avl)
+        sum += item->i;
+    report("scan avl_for_each_entry", count, now() - t);
+    if (sum != sink)
+        printf("scan mismatch: %ld != %ld\n", sum, (long) sink);
+
+    t = now();
+    visited = 0;
+    avl_postorder_for_each_entry_safe (item, n, &root, avl) {
+        free(item);
+        visited++;
+    }
+    INIT_AVL_ROOT(&root);
+    report("free postorder", visited, now() - t);
+
+    /* the old way of tearing down a tree */
+    build_tree(&root, count);
+    t = now();
+    visited = 0;
+    while ((node = avl_first(&root))) {
+        avl_erase(node, &root);
+        free(avl_entry(node, struct avlitem, avl));
+        visited++;
+    }
+    report("free avl_erase", visited, now() - t);
+}
+
+enum pq_pattern { PQ_MONOTONIC, PQ_RANDOM };
+
+static void bench_prio_queue_one(size_t count,
+                                 enum pq_pattern pattern,
+                                 bool balanced)
+{
+    struct avlitem *items = malloc(count * sizeof(*items));
+    struct avl_prio_queue queue;
+    struct avlitem *item;
+    char name[64];
+    int last = -1;
+    double t;
+
+    for (size_t i = 0; i < count; i++)
+        items[i].i = (pattern == PQ_MONOTONIC) ? (int) i : rand();
+
+    avl_prio_queue_init(&queue);
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        if (balanced)
+            avl_prio_queue_insert_balanced(&queue, &items[i]);
+        else
+            avl_prio_queue_insert_unbalanced(&queue, &items[i]);
+    }
+    snprintf(name, sizeof(name), "pq %s %s insert",
+             balanced ? "balanced" : "unbalanced",
+             pattern == PQ_MONOTONIC ? "monotonic" : "random");
+    report(name, count, now() - t);
+    report_shape(name, &queue.root);
+
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        if (balanced)
+            item = avl_prio_queue_pop_balanced(&queue);
+        else
+            item = avl_prio_queue_pop_unbalanced(&queue);
+        if (item->i < last)
+            printf("pq order mismatch: %d < %d\n", item->i, last);
+        last = item->i;
+    }
+    snprintf(name, sizeof(name), "pq %s %s pop",
+             balanced ? "balanced" : "unbalanced",
+             pattern == PQ_MONOTONIC ? "monotonic" : "random");
+    report(name, count, now() - t);
+
+    free(items);
+}
+
+static void bench_prio_queue(size_t count)
+{
+    bench_prio_queue_one(count, PQ_MONOTONIC, false);
+    bench_prio_queue_one(count, PQ_MONOTONIC, true);
+    bench_prio_queue_one(count, PQ_RANDOM, false);
+    bench_prio_queue_one(count, PQ_RANDOM, true);
+}
+
+/* priority queue where every insert allocates its entry and every pop frees
+ * it again, with malloc and with the size-class pool
+ */
+static void bench_alloc_one(size_t count, bool pool)
+{
+    struct avl_prio_queue queue;
+    struct avlitem *item;
+    uint64_t seed = 7;
+    char name[64];
+    double t;
+
+    avl_prio_queue_init(&queue);
+    t = now();
+    for (size_t i = 0; i < 4 * count; i++) {
+        /* grow to count entries, then keep the size */
+        if (i >= count) {
+            item = avl_prio_queue_pop_balanced(&queue);
+            if (pool)
+                pool_free(item, sizeof(*item));
+            else
+                free(item);
+        }
+        item = pool ? pool_alloc(sizeof(*item)) : malloc(sizeof(*item));
+        item->i = xorshift64(&seed) % (1 << 30);
+        avl_prio_queue_insert_balanced(&queue, item);
+    }
+    while ((item = avl_prio_queue_pop_balanced(&queue))) {
+        if (pool)
+            pool_free(item, sizeof(*item));
+        else
+            free(item);
+    }
+    snprintf(name, sizeof(name), "pq alloc %s", pool ? "pool" : "malloc");
+    report(name, 4 * count, now() - t);
+}
+
+static void bench_alloc(size_t count)
+{
+    bench_alloc_one(count, false);
+    bench_alloc_one(count, true);
+}
+
+struct topk_part {
+    pthread_t thread;
+    struct avl_topk topk;
+    struct avlitem *items;
+    size_t count;
+};
+
+static void *topk_part_run(void *arg)
+{
+    struct topk_part *part = arg;
+
+    for (size_t i = 0; i < part->count; i++)
+        avl_topk_push(&part->topk, &part->items[i]);
+    return NULL;
+}
+
+static int cmpint_qsort(const void *a, const void *b)
+{
+    return cmpint(a, b);
+}
+
+/* Check the popped entries against the first k of the sorted values */
+static int topk_check(const char *name,
+                      struct avl_topk *topk,
+                      const int *sorted,
+                      size_t count)
+{
+    size_t k = topk->k < count ? topk->k : count, n = 0;
+    size_t first = topk->order == AVL_TOPK_SMALLEST ? 0 : count - k;
+    struct avlitem *item;
+    int ret = 0;
+
+    while ((item = avl_topk_pop(topk))) {
+        if (n >= k || item->i != sorted[first + n])
+            ret = 1;
+        n++;
+    }
+    if (ret || n != k)
+        printf("%s: wrong selection\n", name);
+    return ret || n != k;
+}
+
+/* k smallest of a random stream: streaming top-k, the same split over
+ * threads and merged, and a full sort through an avl tree
+ */
+static int bench_topk(size_t count)
+{
+    static const size_t ks[] = {16, 1024, 65536};
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct avlitem *items = malloc(count * sizeof(*items));
+    struct topk_part *parts;
+    int *sorted = malloc(count * sizeof(*sorted));
+    char name[64];
+    int ret = 0;
+    double t;
+
+    /* at least two parts so the merge is exercised */
+    nthreads = nthreads < 2 ? 2 : nthreads;
+    parts = calloc(nthreads, sizeof(*parts));
+
+    for (size_t i = 0; i < count; i++)
+        sorted[i] = items[i].i = rand();
+    qsort(sorted, count, sizeof(*sorted), cmpint_qsort);
+
+    for (size_t c = 0; c < sizeof(ks) / sizeof(ks[0]); c++) {
+        size_t k = ks[c];
+        struct avl_topk topk;
+
+        for (int order = AVL_TOPK_SMALLEST; order <= AVL_TOPK_LARGEST;
+             order++) {
+            avl_topk_init(&topk, k, order);
+            t = now();
+            for (size_t i = 0; i < count; i++)
+                avl_topk_push(&topk, &items[i]);
+            snprintf(name, sizeof(name), "topk %s k=%zu",
+                     order == AVL_TOPK_SMALLEST ? "min" : "max", k);
+            report(name, count, now() - t);
+            ret |= topk_check(name, &topk, sorted, count);
+        }
+
+        t = now();
+        for (long p = 0; p < nthreads; p++) {
+            parts[p].items = items + count * p / nthreads;
+            parts[p].count =
+                count * (p + 1) / nthreads - count * p / nthreads;
+            avl_topk_init(&parts[p].topk, k, AVL_TOPK_SMALLEST);
+            if (p)
+                pthread_create(&parts[p].thread, NULL, topk_part_run,
+                               &parts[p]);
+        }
+        topk_part_run(&parts[0]);
+        for (long p = 1; p < nthreads; p++) {
+            pthread_join(parts[p].thread, NULL);
+            avl_topk_merge(&parts[0].topk, &parts[p].topk);
+        }
+        snprintf(name, sizeof(name), "topk min k=%zu %ld threads", k,
+                 nthreads);
+        report(name, count, now() - t);
+        ret |= topk_check(name, &parts[0].topk, sorted, count);
+    }
+
+    /* what the top-k replaces: sort everything, keep the first k */
+    {
+        DEFINE_AVLROOT(root);
+
+        t = now();
+        for (size_t i = 0; i < count; i++)
+            avlitem_insert(&root, &items[i]);
+        for (struct avl_node *node = avl_first(&root); node;
+             node = avl_next(node))
+            ;
+        report("topk by full sort", count, now() - t);
+    }
+
+    free(parts);
+    free(sorted);
+    free(items);
+    return ret;
+}
+
+/* distinct keys in a scrambled order, i * odd is a permutation modulo 2^30 */
+static inline int persistent_key(size_t i)
+{
+    return (int) ((i * 2654435761u) & ((1u << 30) - 1));
+}
+
+/* Build a tree of count keys, then replace random keys count times, in the
+ * mutable avl tree and in the persistent one with a snapshot every @every
+ * updates (0 for none). Only the newest snapshot is kept, like a checkpoint.
+ */
+static int persistent_run(size_t count, size_t every)
+{
+    int *keys = malloc(count * sizeof(*keys));
+    struct pavl_snapshot snap = {NULL, 0};
+    struct pavl_tree tree;
+    char name[64];
+    int ret = 0;
+    double t;
+
+    pavl_init(&tree);
+    srand(1);
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = persistent_key(i);
+        ret |= pavl_insert(&tree, keys[i], NULL);
+        if (every && i % every == 0) {
+            pavl_snapshot_release(&snap);
+            pavl_snapshot(&tree, &snap);
+        }
+    }
+    snprintf(name, sizeof(name), "pavl build snap/%zu", every);
+    report(name, count, now() - t);
+    printf("%-28s %10.2f nodes allocated per op\n", "",
+           (double) tree.allocated / count);
+
+    tree.allocated = 0;
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        size_t j = rand() % count;
+
+        ret |= pavl_erase(&tree, keys[j]);
+        keys[j] = persistent_key(count + i);
+        ret |= pavl_insert(&tree, keys[j], NULL);
+        if (every && i % every == 0) {
+            pavl_snapshot_release(&snap);
+            pavl_snapshot(&tree, &snap);
+        }
+    }
+    snprintf(name, sizeof(name), "pavl churn snap/%zu", every);
+    report(name, count, now() - t);
+    printf("%-28s %10.2f nodes allocated per op\n", "",
+           (double) tree.allocated / count);
+
+    if (!pavl_verify(tree.root, count) || !pavl_verify(snap.root, snap.size))
+        ret = 1;
+    pavl_snapshot_release(&snap);
+    pavl_destroy(&tree);
+    free(keys);
+    return ret;
+}
+
+static int bench_persistent(size_t count)
+{
+    struct avlitem *items = malloc(count * sizeof(*items)), *copy;
+    struct pavl_snapshot snap, old;
+    const struct pavl_node *pos;
+    struct pavl_tree tree;
+    struct pavl_iter it;
+    struct avl_node *node;
+    DEFINE_AVLROOT(root);
+    size_t n = 0;
+    int ret = 0;
+    long sum;
+    double t;
+
+    /* the same workload on the mutable tree */
+    srand(1);
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        items[i].i = persistent_key(i);
+        avlitem_insert(&root, &items[i]);
+    }
+    report("avl build", count, now() - t);
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        size_t j = rand() % count;
+
+        avl_erase(&items[j].avl, &root);
+        items[j].i = persistent_key(count + i);
+        avlitem_insert(&root, &items[j]);
+    }
+    report("avl churn", count, now() - t);
+
+    ret |= persistent_run(count, 0);
+    ret |= persistent_run(count, 1024);
+    ret |= persistent_run(count, 1);
+
+    /* what a snapshot replaces: a copy of all entries */
+    t = now();
+    copy = malloc(count * sizeof(*copy));
+    avl_for_each(node, &root)
+        copy[n++].i = avl_entry(node, struct avlitem, avl)->i;
+    report("avl copy", 1, now() - t);
+    free(copy);
+
+    pavl_init(&tree);
+    for (size_t i = 0; i < count; i++)
+        ret |= pavl_insert(&tree, persistent_key(i), NULL);
+    t = now();
+    for (size_t i = 0; i < count; i++) {
+        pavl_snapshot(&tree, &snap);
+        pavl_snapshot_release(&snap);
+    }
+    report("pavl snapshot", count, now() - t);
+
+    /* an old snapshot keeps its content while the writer goes on */
+    pavl_snapshot(&tree, &old);
+    for (size_t i = 0; i < count; i += 2)
+        ret |= pavl_erase(&tree, persistent_key(i));
+    sum = 0;
+    pavl_for_each(pos, it, old.root)
+        sum += pos->key;
+    for (size_t i = 0; i < count; i++)
+        sum -= persistent_key(i);
+    if (sum || !pavl_verify(old.root, count) ||
+        !pavl_verify(tree.root, count / 2))
+        ret = 1;
+    pavl_snapshot_release(&old);
+    pavl_destroy(&tree);
+
+    if (ret)
+        printf("persistent avl tree check failed\n");
+    free(items);
+    return ret;
+}
+
+/* timer workload: pop the earliest timeout and rearm it, mostly in the near
+ * future and sometimes far away
+ */
+static unsigned long timer_run(size_t count, size_t rounds, bool wheel)
+{
+    struct avlitem *items = malloc(count * sizeof(*items));
+    struct avl_wheel_queue *wq = malloc(sizeof(*wq));
+    struct avl_prio_queue pq;
+    struct avlitem *item;
+    uint64_t seed = 42;
+    unsigned long checksum = 0;
+    int now = 0;
+
+    avl_wheel_queue_init(wq);
+    avl_prio_queue_init(&pq);
+    for (size_t i = 0; i < count; i++) {
+        items[i].i = xorshift64(&seed) % 10000;
+        if (wheel)
+            avl_wheel_queue_insert(wq, &items[i]);
+        else
+            avl_prio_queue_insert_balanced(&pq, &items[i]);
+    }
+
+    for (size_t r = 0; r < rounds; r++) {
+        uint64_t x = xorshift64(&seed);
+
+        if (wheel)
+            item = avl_wheel_queue_pop(wq);
+        else
+            item = avl_prio_queue_pop_balanced(&pq);
+        if (item->i < now)
+            printf("timer order mismatch: %d < %d\n", item->i, now);
+        now = item->i;
+        checksum = checksum * 31 + now;
+
+        if ((x & 0xff) == 0)
+            item->i = now + (1 << 26) + (x >> 40) % 10000;
+        else
+            item->i = now + 1 + (x >> 40) % 10000;
+
+        if (wheel)
+            avl_wheel_queue_insert(wq, item);
+        else
+            avl_prio_queue_insert_balanced(&pq, item);
+    }
+
+    free(wq);
+    free(items);
+    return checksum;
+}
+
+static void bench_timer(size_t count)
+{
+    size_t rounds = 4 * count;
+    unsigned long sum_pq, sum_wheel;
+    double t;
+
+    t = now();
+    sum_pq = timer_run(count, rounds, false);
+    report("timer avl_prio_queue", rounds, now() - t);
+
+    t = now();
+    sum_wheel = timer_run(count, rounds, true);
+    report("timer avl_wheel_queue", rounds, now() - t);
+
+    if (sum_pq != sum_wheel)
+        printf("timer pop order differs\n");
+}
+
+struct latchitem {
+    int i;
+    struct avl_latch_node latch;
+    struct avl_node avl;
+};
+
+static bool latchitem_less(struct avl_latch_node *a, struct avl_latch_node *b)
+{
+    return avl_latch_entry(a, struct latchitem, latch)->i <
+           avl_latch_entry(b, struct latchitem, latch)->i;
+}
+
+static int latchitem_comp(void *key, struct avl_latch_node *b)
+{
+    return cmpint(key, &avl_latch_entry(b, struct latchitem, latch)->i);
+}
+
+static const struct avl_latch_ops latchitem_ops = {
+    .less = latchitem_less,
+    .comp = latchitem_comp,
+};
+
+struct scale_ctx {
+    bool latched;
+    size_t count;
+    struct latchitem *items;
+    struct avl_root root;
+    struct avl_latch_root latch_root;
+    pthread_rwlock_t rwlock;
+    pthread_mutex_t write_lock;
+    int stop;
+};
+
+struct scale_thread {
+    struct scale_ctx *ctx;
+    pthread_t thread;
+    uint64_t seed;
+    size_t ops;
+} __attribute__((aligned(64)));
+
+static void latchitem_insert_plain(struct avl_root *root,
+                                   struct latchitem *new_entry)
+{
+    struct avl_node *parent = NULL;
+    struct avl_node **cur_nodep = &root->node;
+
+    while (*cur_nodep) {
+        parent = *cur_nodep;
+        if (new_entry->i <= avl_entry(parent, struct latchitem, avl)->i)
+            cur_nodep = &parent->left;
+        else
+            cur_nodep = &parent->right;
+    }
+
+    avl_insert(&new_entry->avl, parent, cur_nodep, root);
+}
+
+static struct latchitem *latchitem_find_plain(struct avl_root *root, int key)
+{
+    struct avl_node *node = root->node;
+
+    while (node) {
+        struct latchitem *item = avl_entry(node, struct latchitem, avl);
+        int c = cmpint(&key, &item->i);
+
+        if (c < 0)
+            node = node->left;
+        else if (c > 0)
+            node = node->right;
+        else
+            return item;
+    }
+
+    return NULL;
+}
+
+/* ~99% lookups, ~1% erase + reinsert of an existing entry */
+static void *scale_worker(void *arg)
+{
+    struct scale_thread *self = arg;
+    struct scale_ctx *ctx = self->ctx;
+    struct latchitem *item;
+    size_t ops = 0;
+    uint64_t x;
+    int key;
+
+    while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+        x = xorshift64(&self->seed);
+        key = (int) ((x >> 8) % ctx->count);
+
+        if ((x & 0xff) < 3) {
+            item = &ctx->items[key];
+            if (ctx->latched) {
+                pthread_mutex_lock(&ctx->write_lock);
+                avl_latch_erase(&item->latch, &ctx->latch_root);
+                avl_latch_insert(&item->latch, &ctx->latch_root,
+                                 &latchitem_ops);
+                pthread_mutex_unlock(&ctx->write_lock);
+            } else {
+                pthread_rwlock_wrlock(&ctx->rwlock);
+                avl_erase(&item->avl, &ctx->root);
+                latchitem_insert_plain(&ctx->root, item);
+                pthread_rwlock_unlock(&ctx->rwlock);
+            }
+        } else if (ctx->latched) {
+            avl_latch_find(&key, &ctx->latch_root, &latchitem_ops);
+        } else {
+            pthread_rwlock_rdlock(&ctx->rwlock);
+            latchitem_find_plain(&ctx->root, key);
+            pthread_rwlock_unlock(&ctx->rwlock);
+        }
+        ops++;
+    }
+
+    self->ops = ops;
+    return NULL;
+}
+
+static size_t scale_run(struct scale_ctx *ctx, int nthreads, double seconds)
+{
+    struct scale_thread *threads =
+        aligned_alloc(64, nthreads * sizeof(*threads));
+    struct timespec ts = {
+        .tv_sec = (time_t) seconds,
+        .tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9),
+    };
+    size_t ops = 0;
+
+    ctx->stop = 0;
+    for (int i = 0; i < nthreads; i++) {
+        threads[i].ctx = ctx;
+        threads[i].ops = 0;
+        threads[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        pthread_create(&threads[i].thread, NULL, scale_worker, &threads[i]);
+    }
+
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+    }
+
+    free(threads);
+    return ops;
+}
+
+static void bench_read_scaling(size_t count)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    const double seconds = 0.2;
+    struct scale_ctx ctx = {
+        .count = count,
+    };
+    int *order;
+    size_t ops;
+
+    ctx.items = calloc(count, sizeof(*ctx.items));
+    order = malloc(count * sizeof(*order));
+    for (size_t i = 0; i < count; i++)
+        order[i] = i;
+    for (size_t i = count - 1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        int t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    INIT_AVL_ROOT(&ctx.root);
+    INIT_AVL_LATCH_ROOT(&ctx.latch_root);
+    for (size_t i = 0; i < count; i++) {
+        struct latchitem *item = &ctx.items[order[i]];
+
+        item->i = order[i];
+        latchitem_insert_plain(&ctx.root, item);
+        avl_latch_insert(&item->latch, &ctx.latch_root, &latchitem_ops);
+    }
+    pthread_rwlock_init(&ctx.rwlock, NULL);
+    pthread_mutex_init(&ctx.write_lock, NULL);
+
+    printf("%-8s %14s %14s\n", "threads", "rwlock Mops/s", "latch Mops/s");
+    for (long n = 1; n <= ncpu; n *= 2) {
+        double rw, latch;
+
+        /* always finish with all cores */
+        if (n * 2 > ncpu)
+            n = ncpu;
+
+        ctx.latched = false;
+        ops = scale_run(&ctx, n, seconds);
+        rw = ops / seconds * 1e-6;
+
+        ctx.latched = true;
+        ops = scale_run(&ctx, n, seconds);
+        latch = ops / seconds * 1e-6;
+
+        printf("%-8ld %14.2f %14.2f\n", n, rw, latch);
+    }
+
+    pthread_rwlock_destroy(&ctx.rwlock);
+    pthread_mutex_destroy(&ctx.write_lock);
+    free(order);
+    free(ctx.items);
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = 1 << 20;
+
+    if (argc > 1)
+        count = strtoul(argv[1], NULL, 0);
+
+    srand(0);
+    bench_scan(count);
+    bench_prio_queue(count);
+    bench_timer(count);
+    bench_alloc(count);
+    bench_topk(count);
+    bench_persistent(count);
+    bench_read_scaling(count);
+
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 #include "avltree.h"
 
 struct avl_prio_queue {
@@ -11,6 +13,57 @@ static inline void avl_prio_queue_init(struct avl_prio_queue *queue)
     queue->min_node = NULL;
 }
 
+/* The unbalanced mode skips the avl balancing. To stop monotonic priorities
+ * from degenerating the tree into a list, it is a treap (Seidel, Aragon): every
+ * node also has a pseudo-random weight, a hash of its address, and no node
+ * weighs more than its parent. A new entry is linked as a leaf and rotated up
+ * while it is heavier than its parent, fewer than two rotations on average and
+ * none in half of the inserts. The shape is then the one of a tree built from
+ * the entries in random order, whatever the order of the priorities, so the
+ * expected depth of every entry is O(log n), without any rebuild.
+ *
+ * The minimum has no left child, so popping it only moves its right subtree
+ * up, which keeps the weight order.
+ */
+static inline uint64_t avl_prio_queue_weight(const struct avl_node *node)
+{
+    uint64_t x = (uintptr_t) node;
+
+    /* splitmix64 finalizer */
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* rotate @node above its parent */
+static void avl_prio_queue_rotate_up(struct avl_prio_queue *queue,
+                                     struct avl_node *node)
+{
+    struct avl_node *parent = avl_parent(node);
+    struct avl_node *grand = avl_parent(parent);
+
+    if (parent->left == node) {
+        parent->left = node->right;
+        if (node->right)
+            avl_set_parent(node->right, parent);
+        node->right = parent;
+    } else {
+        parent->right = node->left;
+        if (node->left)
+            avl_set_parent(node->left, parent);
+        node->left = parent;
+    }
+    avl_set_parent(parent, node);
+    avl_set_parent(node, grand);
+
+    if (!grand)
+        queue->root.node = node;
+    else if (grand->left == parent)
+        grand->left = node;
+    else
+        grand->right = node;
+}
+
 static inline void avl_prio_queue_insert_unbalanced(
     struct avl_prio_queue *queue,
     struct avlitem *new_entry)
@@ -19,6 +72,7 @@ static inline void avl_prio_queue_insert_unbalanced(
     struct avl_node **cur_nodep = &queue->root.node;
     struct avlitem *cur_entry;
     int isminimal = 1;
+    uint64_t weight;
 
     while (*cur_nodep) {
         cur_entry = avl_entry(*cur_nodep, struct avlitem, avl);
@@ -36,6 +90,11 @@ static inline void avl_prio_queue_insert_unbalanced(
         queue->min_node = &new_entry->avl;
 
     avl_link_node(&new_entry->avl, parent, cur_nodep);
+
+    weight = avl_prio_queue_weight(&new_entry->avl);
+    while ((parent = avl_parent(&new_entry->avl)) &&
+           avl_prio_queue_weight(parent) < weight)
+        avl_prio_queue_rotate_up(queue, &new_entry->avl);
 }
 
 static inline struct avlitem *avl_prio_queue_pop_unbalanced(
@@ -55,7 +114,7 @@ static inline struct avlitem *avl_prio_queue_pop_unbalanced(
     return item;
 }
 
-tatic inline void avl_prio_queue_insert_balanced(
+static inline void avl_prio_queue_insert_balanced(
     struct avl_prio_queue *queue,
     struct avlitem *new_entry)
 {
@@ -97,3 +156,271 @@ static inline struct avlitem *avl_prio_queue_pop_balanced(
 
     return item;
 }
+
+/* Bounded top-k selection on an avl_prio_queue
+ *
+ * Keeps the k smallest (or largest) entries pushed so far. A new entry only
+ * enters when it beats the worst kept one, which is then evicted: the
+ * maximum, tracked in @max_node, when selecting the smallest, and the minimum
+ * of the queue otherwise. A stream of n entries costs O(n log k) and O(k)
+ * memory. Entries stay owned by the caller, push hands back the one which
+ * is not kept so its memory can be reused.
+ *
+ * Several selectors, e.g. one per thread over parts of the stream, can be
+ * combined with avl_topk_merge.
+ */
+enum avl_topk_order { AVL_TOPK_SMALLEST, AVL_TOPK_LARGEST };
+
+struct avl_topk {
+    struct avl_prio_queue queue;
+    struct avl_node *max_node; /* only maintained for AVL_TOPK_SMALLEST */
+    size_t k, count;
+    enum avl_topk_order order;
+};
+
+static inline void avl_topk_init(struct avl_topk *topk,
+                                 size_t k,
+                                 enum avl_topk_order order)
+{
+    avl_prio_queue_init(&topk->queue);
+    topk->max_node = NULL;
+    topk->k = k;
+    topk->count = 0;
+    topk->order = order;
+}
+
+static inline void avl_topk_link(struct avl_topk *topk, struct avlitem *item)
+{
+    avl_prio_queue_insert_balanced(&topk->queue, item);
+
+    /* equal entries are linked left of the existing ones */
+    if (topk->order == AVL_TOPK_SMALLEST &&
+        (!topk->max_node ||
+         cmpint(&item->i, &avl_entry(topk->max_node, struct avlitem, avl)->i) >
+             0))
+        topk->max_node = &item->avl;
+}
+
+/* Offer @item to @topk. Return: the entry which is not kept, which is @item
+ * itself or the evicted one, or NULL when nothing had to go
+ */
+static inline struct avlitem *avl_topk_push(struct avl_topk *topk,
+                                            struct avlitem *item)
+{
+    struct avlitem *worst;
+
+    if (topk->count < topk->k) {
+        avl_topk_link(topk, item);
+        topk->count++;
+        return NULL;
+    }
+    if (!topk->k)
+        return item;
+
+    if (topk->order == AVL_TOPK_SMALLEST) {
+        worst = avl_entry(topk->max_node, struct avlitem, avl);
+        if (cmpint(&item->i, &worst->i) >= 0)
+            return item;
+
+        topk->max_node = avl_prev(&worst->avl);
+        if (topk->queue.min_node == &worst->avl)
+            topk->queue.min_node = NULL; /* k == 1 */
+        avl_erase(&worst->avl, &topk->queue.root);
+    } else {
+        worst = avl_entry(topk->queue.min_node, struct avlitem, avl);
+        if (cmpint(&item->i, &worst->i) <= 0)
+            return item;
+
+        avl_prio_queue_pop_balanced(&topk->queue);
+    }
+
+    avl_topk_link(topk, item);
+    return worst;
+}
+
+/* Remove the kept entries in ascending order. Return: NULL when empty */
+static inline struct avlitem *avl_topk_pop(struct avl_topk *topk)
+{
+    struct avlitem *item = avl_prio_queue_pop_balanced(&topk->queue);
+
+    if (item && !--topk->count)
+        topk->max_node = NULL;
+    return item;
+}
+
+/* Move the entries of @src into @dst, which keeps the best k of both. @src is
+ * empty afterwards, entries which are not kept are dropped.
+ */
+static inline void avl_topk_merge(struct avl_topk *dst, struct avl_topk *src)
+{
+    struct avlitem *item;
+
+    while ((item = avl_topk_pop(src))) {
+        /* ascending, so no later entry of @src can beat a full @dst either */
+        if (avl_topk_push(dst, item) == item &&
+            dst->order == AVL_TOPK_SMALLEST) {
+            avl_topk_init(src, src->k, src->order);
+            break;
+        }
+    }
+}
+
+/* Hierarchical timing wheel in front of an avl_prio_queue
+ *
+ * Entries whose priority is close to the last popped one are kept in
+ * AVL_WHEEL_LEVELS wheels of AVL_WHEEL_SIZE slots. Level l holds the entries
+ * which differ from @now first in bits [6l, 6l + 6) of the priority, in the
+ * slot selected by these bits. Insert is therefore O(1), and pop finds the
+ * next slot via the occupancy bitmap and cascades the entries of a higher
+ * level slot down once @now reaches it.
+ *
+ * Entries outside the 2^24 wide window of @now, or earlier than @now, go into
+ * the avl_prio_queue @far. Pop compares the smallest entry of both parts, and
+ * moves the next window from @far into the wheels when they run empty. The
+ * combination pops in the same order as a plain avl_prio_queue.
+ *
+ * While an entry sits in a wheel slot, its avl node is not part of any tree
+ * and ->right links the entries of the slot.
+ */
+#define AVL_WHEEL_BITS 6
+#define AVL_WHEEL_SIZE (1 << AVL_WHEEL_BITS)
+#define AVL_WHEEL_LEVELS 4
+#define AVL_WHEEL_SPAN_BITS (AVL_WHEEL_BITS * AVL_WHEEL_LEVELS)
+
+struct avl_wheel_queue {
+    unsigned int now; /* biased priority, see avl_wheel_key */
+    uint64_t occupied[AVL_WHEEL_LEVELS];
+    struct avl_node *slots[AVL_WHEEL_LEVELS][AVL_WHEEL_SIZE];
+    struct avl_prio_queue far;
+};
+
+static inline void avl_wheel_queue_init(struct avl_wheel_queue *queue)
+{
+    queue->now = 0;
+    for (int l = 0; l < AVL_WHEEL_LEVELS; l++) {
+        queue->occupied[l] = 0;
+        for (int s = 0; s < AVL_WHEEL_SIZE; s++)
+            queue->slots[l][s] = NULL;
+    }
+    avl_prio_queue_init(&queue->far);
+}
+
+/* map int priorities to unsigned ones with the same order */
+static inline unsigned int avl_wheel_key(int i)
+{
+    return (unsigned int) i ^ 0x80000000u;
+}
+
+static inline void avl_wheel_queue_place(struct avl_wheel_queue *queue,
+                                         struct avlitem *entry)
+{
+    unsigned int key = avl_wheel_key(entry->i);
+    unsigned int diff = key ^ queue->now;
+    int level = diff ? (31 - __builtin_clz(diff)) / AVL_WHEEL_BITS : 0;
+    int slot = (key >> (level * AVL_WHEEL_BITS)) & (AVL_WHEEL_SIZE - 1);
+
+    entry->avl.right = queue->slots[level][slot];
+    queue->slots[level][slot] = &entry->avl;
+    queue->occupied[level] |= 1ULL << slot;
+}
+
+static inline void avl_wheel_queue_insert(struct avl_wheel_queue *queue,
+                                          struct avlitem *new_entry)
+{
+    unsigned int key = avl_wheel_key(new_entry->i);
+
+    if (key < queue->now || (key ^ queue->now) >> AVL_WHEEL_SPAN_BITS) {
+        avl_prio_queue_insert_balanced(&queue->far, new_entry);
+        return;
+    }
+
+    avl_wheel_queue_place(queue, new_entry);
+}
+
+/* advance @now to the smallest entry in the wheels, NULL when empty */
+static struct avlitem *avl_wheel_queue_peek_wheel(
+    struct avl_wheel_queue *queue)
+{
+    struct avl_node *node, *next;
+    uint64_t pending;
+    unsigned int shift;
+    int level, slot;
+
+    for (level = 0; level < AVL_WHEEL_LEVELS;) {
+        shift = level * AVL_WHEEL_BITS;
+        slot = (queue->now >> shift) & (AVL_WHEEL_SIZE - 1);
+        pending = queue->occupied[level] & (~0ULL << slot);
+        if (!pending) {
+            level++;
+            continue;
+        }
+
+        slot = __builtin_ctzll(pending);
+        if (!level) {
+            queue->now = (queue->now & ~(AVL_WHEEL_SIZE - 1u)) | slot;
+            return avl_entry(queue->slots[0][slot], struct avlitem, avl);
+        }
+
+        /* all lower levels are empty, move @now to the start of the slot
+         * and spread its entries over the lower levels
+         */
+        queue->now = ((queue->now >> shift >> AVL_WHEEL_BITS)
+                      << AVL_WHEEL_BITS | slot)
+                     << shift;
+        node = queue->slots[level][slot];
+        queue->slots[level][slot] = NULL;
+        queue->occupied[level] &= ~(1ULL << slot);
+        for (; node; node = next) {
+            next = node->right;
+            avl_wheel_queue_place(queue, avl_entry(node, struct avlitem, avl));
+        }
+        level = 0;
+    }
+
+    return NULL;
+}
+
+static inline struct avlitem *avl_wheel_queue_pop(
+    struct avl_wheel_queue *queue)
+{
+    struct avlitem *wheel_min, *far_min, *item;
+    struct avl_node *node;
+    unsigned int window;
+    int slot;
+
+    wheel_min = avl_wheel_queue_peek_wheel(queue);
+
+    if (!wheel_min && queue->far.min_node) {
+        /* refill the wheels with the next window of the far queue */
+        far_min = avl_entry(queue->far.min_node, struct avlitem, avl);
+        if (avl_wheel_key(far_min->i) >= queue->now) {
+            queue->now = avl_wheel_key(far_min->i);
+            window = queue->now >> AVL_WHEEL_SPAN_BITS;
+            while (queue->far.min_node) {
+                item = avl_entry(queue->far.min_node, struct avlitem, avl);
+                if (avl_wheel_key(item->i) >> AVL_WHEEL_SPAN_BITS != window)
+                    break;
+                avl_prio_queue_pop_balanced(&queue->far);
+                avl_wheel_queue_place(queue, item);
+            }
+            wheel_min = avl_wheel_queue_peek_wheel(queue);
+        }
+    }
+
+    if (queue->far.min_node) {
+        far_min = avl_entry(queue->far.min_node, struct avlitem, avl);
+        if (!wheel_min || cmpint(&far_min->i, &wheel_min->i) <= 0)
+            return avl_prio_queue_pop_balanced(&queue->far);
+    }
+
+    if (!wheel_min)
+        return NULL;
+
+    slot = queue->now & (AVL_WHEEL_SIZE - 1);
+    node = queue->slots[0][slot];
+    queue->slots[0][slot] = node->right;
+    if (!node->right)
+        queue->occupied[0] &= ~(1ULL << slot);
+
+    return wheel_min;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -58,16 +59,71 @@ struct avl_node {
     struct avl_node *left, *right;
 } AVL_NODE_ALIGNED;
 
+/**
+ * struct avl_stats - statistics of an avl tree
+ * @inserts: number of rebalanced inserts (AVL_STATS only)
+ * @erases: number of erased nodes (AVL_STATS only)
+ * @rotations: number of single rotations, a double rotation counts twice
+ *  (AVL_STATS only)
+ * @nodes: number of nodes in the tree
+ * @height: number of nodes on the longest path from the root to a leaf
+ * @total_depth: sum of the depth of all nodes, the root has depth 1
+ *
+ * The counters are only maintained when AVL_STATS is defined before
+ * avltree.h is included. The shape of the tree is always available through
+ * avl_get_stats. @total_depth / @nodes is the average number of nodes visited
+ * by a successful search.
+ */
+struct avl_stats {
+    unsigned long inserts;
+    unsigned long erases;
+    unsigned long rotations;
+    size_t nodes;
+    size_t height;
+    size_t total_depth;
+};
+
 /**
  * struct avl_root - root of an avl-tree
  * @node: pointer to the root node in the tree
+ * @stats: event counters, only with AVL_STATS
  *
  * For an empty tree, node points to NULL.
  */
 struct avl_root {
     struct avl_node *node;
+#ifdef AVL_STATS
+    struct avl_stats stats;
+#endif
 };
 
+#ifdef AVL_STATS
+#define AVL_STAT_INC(root, counter) ((root)->stats.counter++)
+#else
+#define AVL_STAT_INC(root, counter) ((void) (root))
+#endif
+
+/**
+ * avl_assign_pointer() - Store a child or root pointer of a linked node
+ * @p: pointer lvalue to modify
+ * @v: new value
+ *
+ * All writes to links which are reachable from the root go through this
+ * helper. The release store keeps the writes in program order, so a lockless
+ * reader (see avltree_latch.h) never observes a node before its
+ * initialization or a rotation which temporarily forms a cycle. On x86 this is
+ * a plain store.
+ */
+#define avl_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/**
+ * avl_read_pointer() - Load a child or root pointer for a lockless reader
+ * @p: pointer lvalue to read
+ *
+ * Return: current value of @p
+ */
+#define avl_read_pointer(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
 /**
  * DEFINE_AVLROOT - define tree root and initialize it
  * @root: name of the new object
@@ -81,6 +137,9 @@ struct avl_root {
 static inline void INIT_AVL_ROOT(struct avl_root *root)
 {
     root->node = NULL;
+#ifdef AVL_STATS
+    root->stats = (struct avl_stats){0};
+#endif
 }
 
 /**
@@ -102,7 +161,7 @@ static inline int avl_empty(const struct avl_root *root)
  */
 static inline struct avl_node *avl_parent(struct avl_node *node)
 {
-    return (struct avl_node *) (IIII);
+    return (struct avl_node *) (node->parent_balance & ~3UL);
 }
 
 /**
@@ -113,7 +172,7 @@ static inline struct avl_node *avl_parent(struct avl_node *node)
  */
 static inline enum avl_node_balance avl_balance(const struct avl_node *node)
 {
-    return (enum avl_node_balance)(JJJJ);
+    return (enum avl_node_balance)(node->parent_balance & 3UL);
 }
 
 /**
@@ -149,10 +208,10 @@ static inline void avl_link_node(struct avl_node *node,
                                  struct avl_node **avl_link)
 {
     avl_set_parent_balance(node, parent, AVL_NEUTRAL);
-    node->left = NULL;
-    node->right = NULL;
+    avl_assign_pointer(node->left, NULL);
+    avl_assign_pointer(node->right, NULL);
 
-    *avl_link = node;
+    avl_assign_pointer(*avl_link, node);
 }
 
 void avl_insert_balance(struct avl_node *node, struct avl_root *root);
@@ -200,6 +259,90 @@ struct avl_node *avl_last(const struct avl_root *root);
 struct avl_node *avl_next(struct avl_node *node);
 struct avl_node *avl_prev(struct avl_node *node);
 
+void avl_get_stats(const struct avl_root *root, struct avl_stats *stats);
+bool avl_verify(const struct avl_root *root,
+                int (*cmp)(const struct avl_node *a,
+                           const struct avl_node *b));
+
+/**
+ * avl_assert_valid() - Check the whole tree in debug builds
+ * @root: pointer to avl root
+ * @cmp: comparison function of the nodes, see avl_verify
+ *
+ * Expands to nothing when NDEBUG is defined.
+ */
+#define avl_assert_valid(root, cmp) assert(avl_verify(root, cmp))
+
+/**
+ * struct avl_root_cached - avl root which also tracks the smallest and the
+ *  largest node
+ * @avl_root: the tree
+ * @avl_leftmost: smallest node, NULL for an empty tree
+ * @avl_rightmost: largest node, NULL for an empty tree
+ *
+ * The cached ends let avl_insert_hint append a node in front of the smallest
+ * or behind the largest node without walking the tree. All inserts and erases
+ * have to go through the _cached helpers to keep them up to date.
+ */
+struct avl_root_cached {
+    struct avl_root avl_root;
+    struct avl_node *avl_leftmost, *avl_rightmost;
+};
+
+/**
+ * INIT_AVL_ROOT_CACHED() - Initialize empty tree with cached ends
+ * @root: pointer to cached avl root
+ */
+static inline void INIT_AVL_ROOT_CACHED(struct avl_root_cached *root)
+{
+    INIT_AVL_ROOT(&root->avl_root);
+    root->avl_leftmost = root->avl_rightmost = NULL;
+}
+
+/**
+ * avl_insert_cached() - Add new node as new leaf, rebalance tree and update
+ *  the cached ends
+ * @node: pointer to the new node
+ * @parent: pointer to the parent node
+ * @avl_link: pointer to the left/right pointer of @parent
+ * @root: pointer to cached avl root
+ */
+static inline void avl_insert_cached(struct avl_node *node,
+                                     struct avl_node *parent,
+                                     struct avl_node **avl_link,
+                                     struct avl_root_cached *root)
+{
+    /* rotations never change which node is the smallest or the largest */
+    if (!parent || (parent == root->avl_leftmost && avl_link == &parent->left))
+        root->avl_leftmost = node;
+    if (!parent ||
+        (parent == root->avl_rightmost && avl_link == &parent->right))
+        root->avl_rightmost = node;
+    avl_insert(node, parent, avl_link, &root->avl_root);
+}
+
+/**
+ * avl_erase_cached() - Remove avl node from tree, rebalance tree and update
+ *  the cached ends
+ * @node: pointer to the node
+ * @root: pointer to cached avl root
+ */
+static inline void avl_erase_cached(struct avl_node *node,
+                                    struct avl_root_cached *root)
+{
+    if (node == root->avl_leftmost)
+        root->avl_leftmost = avl_next(node);
+    if (node == root->avl_rightmost)
+        root->avl_rightmost = avl_prev(node);
+    avl_erase(node, &root->avl_root);
+}
+
+void avl_insert_hint(struct avl_node *node,
+                     struct avl_node *hint,
+                     struct avl_root_cached *root,
+                     int (*cmp)(const struct avl_node *a,
+                                const struct avl_node *b));
+
 /**
  * avl_entry() - Calculate address of entry that contains tree node
  * @node: pointer to tree node
@@ -210,6 +353,121 @@ struct avl_node *avl_prev(struct avl_node *node);
  */
 #define avl_entry(node, type, member) container_of(node, type, member)
 
+/**
+ * avl_entry_safe() - Calculate address of entry or NULL for NULL node
+ * @node: pointer to tree node or NULL
+ * @type: type of the entry containing the tree node
+ * @member: name of the avl_node member variable in struct @type
+ *
+ * Return: @type pointer of entry containing node, NULL when @node is NULL
+ */
+#define avl_entry_safe(node, type, member)                   \
+    __extension__({                                          \
+        __typeof__(node) __node = (node);                    \
+        __node ? avl_entry(__node, type, member) : NULL;     \
+    })
+
+/**
+ * avl_prefetch() - Hint the cache that node will be accessed soon
+ * @node: pointer to the avl node, may be NULL
+ *
+ * Only the cache line with the start of @node is fetched. AVL_NODE_ALIGNED
+ * only aligns a node to unsigned long, so a node can straddle two lines, and
+ * then the child pointers are not covered.
+ */
+#define avl_prefetch(node) __builtin_prefetch(node)
+
+/* number of lookups avl_find_batch keeps in flight */
+#define AVL_FIND_BATCH_LANES 16
+
+void avl_find_batch(const struct avl_root *root,
+                    const void *keys,
+                    size_t key_size,
+                    size_t n,
+                    int (*cmp)(const void *key, const struct avl_node *node),
+                    struct avl_node **out);
+
+struct avl_node *avl_first_postorder(const struct avl_root *root);
+struct avl_node *avl_next_postorder(struct avl_node *node);
+
+/**
+ * avl_next_prefetch() - Find successor node and prefetch the one after it
+ * @node: starting avl node for search
+ *
+ * Same as avl_next but warms the cache for the following step. The
+ * successor of the returned node is either the leftmost node under its right
+ * child or one of its ancestors, which were just touched by the search. Only
+ * the right child is therefore likely to miss.
+ *
+ * Return: pointer to successor node. NULL when no successor of @node exist.
+ */
+static inline struct avl_node *avl_next_prefetch(struct avl_node *node)
+{
+    struct avl_node *next = avl_next(node);
+
+    if (next)
+        avl_prefetch(next->right);
+
+    return next;
+}
+
+/**
+ * avl_for_each() - Iterate over avl nodes in ascending order
+ * @pos: struct avl_node * to use as loop cursor
+ * @root: pointer to avl root
+ */
+#define avl_for_each(pos, root) \
+    for (pos = avl_first(root); pos; pos = avl_next_prefetch(pos))
+
+/**
+ * avl_for_each_entry() - Iterate over entries in ascending order
+ * @pos: @type * to use as loop cursor
+ * @root: pointer to avl root
+ * @member: name of the avl_node member variable in the entry
+ *
+ * The tree must not be modified inside the loop body.
+ */
+#define avl_for_each_entry(pos, root, member)                            \
+    for (pos = avl_entry_safe(avl_first(root), __typeof__(*pos), member); \
+         pos; pos = avl_entry_safe(avl_next_prefetch(&pos->member),      \
+                                   __typeof__(*pos), member))
+
+/**
+ * avl_for_each_entry_reverse() - Iterate over entries in descending order
+ * @pos: @type * to use as loop cursor
+ * @root: pointer to avl root
+ * @member: name of the avl_node member variable in the entry
+ *
+ * The tree must not be modified inside the loop body.
+ */
+#define avl_for_each_entry_reverse(pos, root, member)                   \
+    for (pos = avl_entry_safe(avl_last(root), __typeof__(*pos), member); \
+         pos; pos = avl_entry_safe(avl_prev(&pos->member),               \
+                                   __typeof__(*pos), member))
+
+/**
+ * avl_postorder_for_each_entry_safe() - Iterate over entries in post-order
+ * @pos: @type * to use as loop cursor
+ * @n: another @type * to use as temporary storage
+ * @root: pointer to avl root
+ * @member: name of the avl_node member variable in the entry
+ *
+ * Children are visited before their parent, and the next entry is looked up
+ * before the loop body runs. The body may therefore free @pos, which makes
+ * this the O(n) way to tear down a whole tree without any rebalancing. The
+ * tree is left in an undefined state afterwards and @root has to be
+ * reinitialized with INIT_AVL_ROOT before it is used again.
+ */
+#define avl_postorder_for_each_entry_safe(pos, n, root, member)              \
+    for (pos = avl_entry_safe(avl_first_postorder(root), __typeof__(*pos),  \
+                              member);                                       \
+         pos && ({                                                           \
+             n = avl_entry_safe(avl_next_postorder(&pos->member),            \
+                                __typeof__(*pos), member);                   \
+             1;                                                              \
+         });                                                                 \
+         pos = n)
+
 /**
  * avl_set_parent() - Set parent of node
  * @node: pointer to the avl node
@@ -218,7 +476,7 @@ struct avl_node *avl_prev(struct avl_node *node);
 static void avl_set_parent(struct avl_node *node, struct avl_node *parent)
 {
     node->parent_balance =
-        (unsigned long) parent | (KKKK);
+        (unsigned long) parent | avl_balance(node);
 }
 
 /**
@@ -229,7 +487,7 @@ static void avl_set_parent(struct avl_node *node, struct avl_node *parent)
 static void avl_set_balance(struct avl_node *node,
                             enum avl_node_balance balance)
 {
-    node->parent_balance = (LLLL) | balance;
+    node->parent_balance = (unsigned long) avl_parent(node) | balance;
 }
 
 /**
@@ -251,11 +509,11 @@ static void avl_change_child(struct avl_node *old_node,
 {
     if (parent) {
         if (parent->left == old_node)
-            parent->left = new_node;
+            avl_assign_pointer(parent->left, new_node);
         else
-            parent->right = new_node;
+            avl_assign_pointer(parent->right, new_node);
     } else {
-        root->node = new_node;
+        avl_assign_pointer(root->node, new_node);
     }
 }
 
@@ -281,6 +539,8 @@ static void avl_rotate_switch_parents(struct avl_node *node_top,
                                       enum avl_node_balance balance_top,
                                       enum avl_node_balance balance_child)
 {
+    AVL_STAT_INC(root, rotations);
+
     /* switch parents and set new balance */
     avl_set_parent_balance(node_top, avl_parent(node_child), balance_top);
     avl_set_parent_balance(node_child, node_top, balance_child);
@@ -337,8 +597,8 @@ static struct avl_node *avl_rotate_rightleft(struct avl_node *node,
 
     /* rotate right */
     tmp = node->left;
-    node->left = tmp->right;
-    tmp->right = node;
+    avl_assign_pointer(node->left, tmp->right);
+    avl_assign_pointer(tmp->right, node);
 
     switch (avl_balance(tmp)) {
     default:
@@ -361,8 +621,8 @@ static struct avl_node *avl_rotate_rightleft(struct avl_node *node,
 
     /* rotate left */
     tmp = parent->right;
-    parent->right = tmp->left;
-    tmp->left = parent;
+    avl_assign_pointer(parent->right, tmp->left);
+    avl_assign_pointer(tmp->left, parent);
 
     avl_rotate_switch_parents(tmp, parent, parent->right, root, AVL_NEUTRAL,
                               balance_parent);
@@ -394,8 +654,8 @@ static struct avl_node *avl_rotate_leftright(struct avl_node *node,
 
     /* rotate left */
     tmp = node->right;
-    node->right = tmp->left;
-    tmp->left = node;
+    avl_assign_pointer(node->right, tmp->left);
+    avl_assign_pointer(tmp->left, node);
 
     switch (avl_balance(tmp)) {
     default:
@@ -418,8 +678,8 @@ static struct avl_node *avl_rotate_leftright(struct avl_node *node,
 
     /* rotate right */
     tmp = parent->left;
-    parent->left = tmp->right;
-    tmp->right = parent;
+    avl_assign_pointer(parent->left, tmp->right);
+    avl_assign_pointer(tmp->right, parent);
 
     avl_rotate_switch_parents(tmp, parent, parent->left, root, AVL_NEUTRAL,
                               balance_parent);
@@ -464,8 +724,8 @@ static struct avl_node *avl_rotate_left(struct avl_node *node,
 
     /* rotate left */
     tmp = parent->right;
-    parent->right = tmp->left;
-    tmp->left = parent;
+    avl_assign_pointer(parent->right, tmp->left);
+    avl_assign_pointer(tmp->left, parent);
 
     avl_rotate_switch_parents(tmp, parent, parent->right, root, balance_node,
                               balance_parent);
@@ -510,8 +770,8 @@ static struct avl_node *avl_rotate_right(struct avl_node *node,
 
     /* rotate right */
     tmp = parent->left;
-    parent->left = tmp->right;
-    tmp->right = parent;
+    avl_assign_pointer(parent->left, tmp->right);
+    avl_assign_pointer(tmp->right, parent);
 
     avl_rotate_switch_parents(tmp, parent, parent->left, root, balance_node,
                               balance_parent);
@@ -535,6 +795,8 @@ void avl_insert_balance(struct avl_node *node, struct avl_root *root)
 {
     struct avl_node *parent;
 
+    AVL_STAT_INC(root, inserts);
+
     /* go tree upwards and fix the nodes on the way */
     while ((parent = avl_parent(node))) {
         if (avl_is_right_child(node)) {
@@ -591,10 +853,10 @@ void avl_insert_balance(struct avl_node *node, struct avl_root *root)
                 default:
                 case AVL_LEFT:
                 case AVL_NEUTRAL:
-                    MMMM(node, parent, root);
+                    avl_rotate_right(node, parent, root);
                     break;
                 case AVL_RIGHT:
-                    NNNN(node, parent, root);
+                    avl_rotate_leftright(node, parent, root);
                     break;
                 }
 
@@ -610,6 +872,74 @@ void avl_insert_balance(struct avl_node *node, struct avl_root *root)
     }
 }
 
+/**
+ * avl_insert_hint() - Insert a node, starting the search at a nearby node
+ * @node: pointer to the new node, its key has to be set
+ * @hint: node close to the position of @node, e.g. the last inserted one.
+ *  NULL starts the search at the root.
+ * @root: pointer to cached avl root
+ * @cmp: comparison function, see avl_verify
+ *
+ * A node which belongs behind the largest or in front of the smallest node is
+ * linked there directly. Otherwise the search climbs from @hint only until it
+ * reaches a subtree whose key range covers @node, and descends from there.
+ * Together with the amortized O(1) rebalancing after inserts, sorted and
+ * nearly sorted streams are placed in amortized O(1) when the last inserted
+ * node is passed as @hint.
+ *
+ * Nodes with the same key as @node stay in front of it.
+ */
+void avl_insert_hint(struct avl_node *node,
+                     struct avl_node *hint,
+                     struct avl_root_cached *root,
+                     int (*cmp)(const struct avl_node *a,
+                                const struct avl_node *b))
+{
+    struct avl_node **avl_link = &root->avl_root.node;
+    struct avl_node *parent = NULL, *top;
+
+    /* Climbing from a node next to the right or left spine would go up to
+     * the root for a new largest or smallest key, which gets linked directly
+     */
+    if (hint && cmp(node, hint) >= 0) {
+        top = root->avl_rightmost;
+        if (hint == top || cmp(node, top) >= 0) {
+            avl_insert_cached(node, top, &top->right, root);
+            return;
+        }
+        /* climb until @node is smaller than the parent of a left subtree */
+        for (top = hint; (parent = avl_parent(top)); top = parent) {
+            if (top == parent->left && cmp(node, parent) < 0)
+                break;
+        }
+    } else if (hint) {
+        top = root->avl_leftmost;
+        if (hint == top || cmp(node, top) < 0) {
+            avl_insert_cached(node, top, &top->left, root);
+            return;
+        }
+        /* climb until @node is not smaller than the parent of a right
+         * subtree
+         */
+        for (top = hint; (parent = avl_parent(top)); top = parent) {
+            if (top == parent->right && cmp(node, parent) >= 0)
+                break;
+        }
+    }
+    if (parent)
+        avl_link = top == parent->left ? &parent->left : &parent->right;
+
+    while (*avl_link) {
+        parent = *avl_link;
+        if (cmp(node, parent) < 0)
+            avl_link = &parent->left;
+        else
+            avl_link = &parent->right;
+    }
+
+    avl_insert_cached(node, parent, avl_link, root);
+}
+
 /**
  * avl_erase_node() - Remove avl node from tree
  * @node: pointer to the node
@@ -638,6 +968,8 @@ struct avl_node *avl_erase_node(struct avl_node *node,
     struct avl_node *smallest_parent;
     struct avl_node *decreased_node;
 
+    AVL_STAT_INC(root, erases);
+
     if (!node->left && !node->right) {
         /* no child
          * just delete the current child
@@ -688,10 +1020,10 @@ struct avl_node *avl_erase_node(struct avl_node *node,
     /* exchange node with smallest */
     avl_set_parent_balance(smallest, avl_parent(node), avl_balance(node));
 
-    smallest->left = node->left;
+    avl_assign_pointer(smallest->left, node->left);
     avl_set_parent(smallest->left, smallest);
 
-    smallest->right = node->right;
+    avl_assign_pointer(smallest->right, node->right);
     if (smallest->right)
         avl_set_parent(smallest->right, smallest);
 
@@ -915,3 +1247,250 @@ struct avl_node *avl_prev(struct avl_node *node)
 
     return parent;
 }
+
+/**
+ * avl_find_batch() - Look up many keys with overlapping cache misses
+ * @root: pointer to avl root
+ * @keys: array of @n keys
+ * @key_size: distance between two keys in @keys in bytes
+ * @n: number of keys
+ * @cmp: comparison function, < 0 when @key is smaller than the key of @node,
+ *  0 when both are equal and > 0 otherwise
+ * @out: matching node or NULL for every key
+ *
+ * Up to AVL_FIND_BATCH_LANES lookups advance in turns, each one a single
+ * level per turn with the next node prefetched. The cache misses of different
+ * lookups overlap instead of stalling one after another, which pays off when
+ * the tree does not fit into the cache. A finished lookup hands its lane to the
+ * next key, so lookups of different depth never wait for each other.
+ */
+void avl_find_batch(const struct avl_root *root,
+                    const void *keys,
+                    size_t key_size,
+                    size_t n,
+                    int (*cmp)(const void *key, const struct avl_node *node),
+                    struct avl_node **out)
+{
+    struct {
+        struct avl_node *node;
+        size_t i;
+    } lane[AVL_FIND_BATCH_LANES];
+    size_t next = 0, active = 0;
+
+    for (; active < AVL_FIND_BATCH_LANES && next < n; active++, next++) {
+        lane[active].node = root->node;
+        lane[active].i = next;
+    }
+
+    while (active) {
+        for (size_t l = 0; l < active;) {
+            struct avl_node *node = lane[l].node;
+            const void *key = (const char *) keys + lane[l].i * key_size;
+            int res;
+
+            if (node && (res = cmp(key, node))) {
+                node = res < 0 ? node->left : node->right;
+                avl_prefetch(node);
+                lane[l++].node = node;
+                continue;
+            }
+
+            out[lane[l].i] = node;
+            if (next < n) {
+                lane[l].node = root->node;
+                lane[l++].i = next++;
+            } else {
+                lane[l] = lane[--active];
+            }
+        }
+    }
+}
+
+/**
+ * avl_left_deepest_node() - Find first node of subtree in post-order
+ * @node: root of the subtree, must not be NULL
+ *
+ * Return: deepest node reached by preferring left over right children
+ */
+static struct avl_node *avl_left_deepest_node(struct avl_node *node)
+{
+    for (;;) {
+        if (node->left)
+            node = node->left;
+        else if (node->right)
+            node = node->right;
+        else
+            return node;
+    }
+}
+
+/**
+ * avl_first_postorder() - Find first avl node in post-order
+ * @root: pointer to avl root
+ *
+ * Return: pointer to first node visited in post-order. NULL when @root is
+ *  empty.
+ */
+struct avl_node *avl_first_postorder(const struct avl_root *root)
+{
+    if (!root->node)
+        return NULL;
+
+    return avl_left_deepest_node(root->node);
+}
+
+/**
+ * avl_next_postorder() - Find post-order successor node in tree
+ * @node: starting avl node for search
+ *
+ * Only @node and its ancestors are read, so the children of @node may already
+ * be free'd when this is called.
+ *
+ * Return: pointer to post-order successor. NULL when @node is the root.
+ */
+struct avl_node *avl_next_postorder(struct avl_node *node)
+{
+    struct avl_node *parent;
+
+    if (!node)
+        return NULL;
+
+    /* left subtree done, continue with the right sibling subtree */
+    parent = avl_parent(node);
+    if (parent && node == parent->left && parent->right)
+        return avl_left_deepest_node(parent->right);
+
+    /* both subtrees done, the parent itself is next */
+    return parent;
+}
+
+/**
+ * avl_get_stats() - Collect statistics and shape of the tree
+ * @root: pointer to avl root
+ * @stats: returns the event counters of @root and the current shape
+ *
+ * The tree is walked without recursion or stack, so it also works for
+ * degenerated trees created by avl_link_node without rebalancing. The cost is
+ * O(n).
+ */
+void avl_get_stats(const struct avl_root *root, struct avl_stats *stats)
+{
+    struct avl_node *node = root->node;
+    struct avl_node *prev = NULL;
+    struct avl_node *next;
+    size_t depth = 1;
+
+#ifdef AVL_STATS
+    *stats = root->stats;
+#else
+    *stats = (struct avl_stats){0};
+#endif
+    stats->nodes = 0;
+    stats->height = 0;
+    stats->total_depth = 0;
+
+    while (node) {
+        if (prev == avl_parent(node)) {
+            /* first visit, coming from above */
+            stats->nodes++;
+            stats->total_depth += depth;
+            if (depth > stats->height)
+                stats->height = depth;
+
+            if (node->left)
+                next = node->left;
+            else if (node->right)
+                next = node->right;
+            else
+                next = avl_parent(node);
+        } else if (prev == node->left && node->right) {
+            /* left subtree done */
+            next = node->right;
+        } else {
+            /* both subtrees done */
+            next = avl_parent(node);
+        }
+
+        if (next == avl_parent(node))
+            depth--;
+        else
+            depth++;
+
+        prev = node;
+        node = next;
+    }
+}
+
+/* avl trees are never higher than 1.44 * log2(n), so this never triggers for
+ * valid trees and prevents deep recursion in corrupted ones
+ */
+#define AVL_VERIFY_MAX_HEIGHT 96
+
+static int avl_verify_subtree(const struct avl_node *node,
+                              const struct avl_node *parent,
+                              int depth)
+{
+    int left_height, right_height;
+    enum avl_node_balance balance;
+
+    if (!node)
+        return 0;
+
+    if (depth > AVL_VERIFY_MAX_HEIGHT)
+        return -1;
+
+    if (avl_parent((struct avl_node *) node) != parent)
+        return -1;
+
+    left_height = avl_verify_subtree(node->left, node, depth + 1);
+    right_height = avl_verify_subtree(node->right, node, depth + 1);
+    if (left_height < 0 || right_height < 0)
+        return -1;
+
+    if (left_height == right_height)
+        balance = AVL_NEUTRAL;
+    else if (left_height == right_height + 1)
+        balance = AVL_LEFT;
+    else if (right_height == left_height + 1)
+        balance = AVL_RIGHT;
+    else
+        return -1;
+
+    if (avl_balance(node) != balance)
+        return -1;
+
+    return (left_height > right_height ? left_height : right_height) + 1;
+}
+
+/**
+ * avl_verify() - Check all invariants of the tree
+ * @root: pointer to avl root
+ * @cmp: comparison function, < 0 when @a is smaller than @b, 0 when both are
+ *  equal and > 0 otherwise. NULL skips the order check.
+ *
+ * Checks that all parent pointers match the child pointers, that the stored
+ * balance of every node matches the heights of its subtrees, that no subtree
+ * is more than one level higher than its sibling and that an in-order walk
+ * returns the nodes in ascending order. The cost is O(n).
+ *
+ * Return: true when @root is a valid avl tree
+ */
+bool avl_verify(const struct avl_root *root,
+                int (*cmp)(const struct avl_node *a, const struct avl_node *b))
+{
+    struct avl_node *node, *next;
+
+    if (avl_verify_subtree(root->node, NULL, 1) < 0)
+        return false;
+
+    if (!cmp)
+        return true;
+
+    for (node = avl_first(root); node; node = next) {
+        next = avl_next(node);
+        if (next && cmp(node, next) > 0)
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+/*
+ * Latched avl trees for lockless lookups
+ *
+ * Every entry is linked into two avl trees at the same time. A sequence
+ * counter selects which of the two copies readers have to use: while the
+ * writer modifies copy 0 the counter is odd and readers walk copy 1, and vice
+ * versa. A reader only has to retry when the counter changed during its
+ * lookup, so it never waits for a writer and never writes to shared memory.
+ *
+ * Readers can still observe the copy under modification when they started
+ * right before the counter changed. avltree.h publishes every link through
+ * avl_assign_pointer in an order which never forms a cycle, so such a reader
+ * terminates and the changed sequence count makes it retry.
+ *
+ * Writers must be serialized by the caller, e.g. with a mutex. Removed
+ * entries may still be referenced by readers and must not be free'd before
+ * all concurrent lookups have finished (RCU or epoch based reclamation).
+ */
+
+#include "avltree.h"
+
+/**
+ * struct avl_latch_node - node of a latched avl tree
+ * @node: tree node for each of the two copies
+ */
+struct avl_latch_node {
+    struct avl_node node[2];
+};
+
+/**
+ * struct avl_latch_root - root of a latched avl tree
+ * @seq: sequence counter, lowest bit selects the copy for readers
+ * @tree: roots of the two copies
+ */
+struct avl_latch_root {
+    unsigned int seq;
+    struct avl_root tree[2];
+};
+
+/**
+ * struct avl_latch_ops - ordering of entries in a latched avl tree
+ * @less: used for insertion, true when @a has to be placed before @b
+ * @comp: used for lookup, < 0 when @key is smaller than the key of @b, 0 on a
+ *  match and > 0 otherwise
+ */
+struct avl_latch_ops {
+    bool (*less)(struct avl_latch_node *a, struct avl_latch_node *b);
+    int (*comp)(void *key, struct avl_latch_node *b);
+};
+
+/**
+ * INIT_AVL_LATCH_ROOT() - Initialize empty latched tree
+ * @root: pointer to latched avl root
+ */
+static inline void INIT_AVL_LATCH_ROOT(struct avl_latch_root *root)
+{
+    root->seq = 0;
+    INIT_AVL_ROOT(&root->tree[0]);
+    INIT_AVL_ROOT(&root->tree[1]);
+}
+
+/**
+ * avl_latch_entry() - Calculate address of entry that contains latch node
+ * @node: pointer to latch node
+ * @type: type of the entry containing the latch node
+ * @member: name of the avl_latch_node member variable in struct @type
+ *
+ * Return: @type pointer of entry containing node
+ */
+#define avl_latch_entry(node, type, member) container_of(node, type, member)
+
+/**
+ * avl_latch_write_seq() - Switch readers to the other copy
+ * @root: pointer to latched avl root
+ */
+static inline void avl_latch_write_seq(struct avl_latch_root *root)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&root->seq, root->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline struct avl_latch_node *__avl_latch_from(struct avl_node *node,
+                                                      int idx)
+{
+    return container_of(node, struct avl_latch_node, node[idx]);
+}
+
+static inline void __avl_latch_insert(struct avl_latch_node *latch,
+                                      struct avl_latch_root *root,
+                                      int idx,
+                                      const struct avl_latch_ops *ops)
+{
+    struct avl_node *parent = NULL;
+    struct avl_node **cur_nodep = &root->tree[idx].node;
+
+    while (*cur_nodep) {
+        parent = *cur_nodep;
+        if (ops->less(latch, __avl_latch_from(parent, idx)))
+            cur_nodep = &parent->left;
+        else
+            cur_nodep = &parent->right;
+    }
+
+    avl_insert(&latch->node[idx], parent, cur_nodep, &root->tree[idx]);
+}
+
+static inline struct avl_latch_node *__avl_latch_find(
+    void *key,
+    struct avl_latch_root *root,
+    int idx,
+    const struct avl_latch_ops *ops)
+{
+    struct avl_node *node = avl_read_pointer(root->tree[idx].node);
+    int c;
+
+    while (node) {
+        c = ops->comp(key, __avl_latch_from(node, idx));
+        if (c < 0)
+            node = avl_read_pointer(node->left);
+        else if (c > 0)
+            node = avl_read_pointer(node->right);
+        else
+            return __avl_latch_from(node, idx);
+    }
+
+    return NULL;
+}
+
+/**
+ * avl_latch_insert() - Add latch node to both copies of the tree
+ * @latch: pointer to the new latch node
+ * @root: pointer to latched avl root
+ * @ops: ordering of the entries
+ *
+ * Must be serialized against other writers.
+ */
+static inline void avl_latch_insert(struct avl_latch_node *latch,
+                                    struct avl_latch_root *root,
+                                    const struct avl_latch_ops *ops)
+{
+    avl_latch_write_seq(root);
+    __avl_latch_insert(latch, root, 0, ops);
+    avl_latch_write_seq(root);
+    __avl_latch_insert(latch, root, 1, ops);
+}
+
+/**
+ * avl_latch_erase() - Remove latch node from both copies of the tree
+ * @latch: pointer to the latch node
+ * @root: pointer to latched avl root
+ *
+ * Must be serialized against other writers. @latch may still be accessed by
+ * concurrent readers after the return.
+ */
+static inline void avl_latch_erase(struct avl_latch_node *latch,
+                                   struct avl_latch_root *root)
+{
+    avl_latch_write_seq(root);
+    avl_erase(&latch->node[0], &root->tree[0]);
+    avl_latch_write_seq(root);
+    avl_erase(&latch->node[1], &root->tree[1]);
+}
+
+/**
+ * avl_latch_find() - Lockless lookup of a key
+ * @key: pointer to the key, passed to @ops->comp
+ * @root: pointer to latched avl root
+ * @ops: ordering of the entries
+ *
+ * May run concurrently with avl_latch_insert and avl_latch_erase.
+ *
+ * Return: latch node matching @key, NULL when no such node exists
+ */
+static inline struct avl_latch_node *avl_latch_find(
+    void *key,
+    struct avl_latch_root *root,
+    const struct avl_latch_ops *ops)
+{
+    struct avl_latch_node *node;
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&root->seq, __ATOMIC_ACQUIRE);
+        node = __avl_latch_find(key, root, seq & 1, ops);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&root->seq, __ATOMIC_RELAXED) != seq);
+
+    return node;
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+/*
+ * Integer logarithms of base 2
+ *
+ * floor_log2 and ceil_log2 for 32 and 64 bit values. With GCC and clang they
+ * are built on __builtin_clz, which is a single BSR or LZCNT instruction on
+ * x86. Other compilers get the table and shift cascade versions, which are
+ * also always available under their own names for comparison.
+ *
+ * FLOOR_LOG2_CONST and CEIL_LOG2_CONST are integer constant expressions for
+ * array sizes, static initializers and case labels.
+ *
+ * The batch versions work on arrays and use LZCNT when the CPU has it, the
+ * choice is made once at the first call.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_BUILTIN_CLZ 1
+#endif
+
+#if defined(HAVE_BUILTIN_CLZ) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_LZCNT_DISPATCH 1
+#endif
+
+#define __LOG2_CONST_1(n) ((n) >= 2)
+#define __LOG2_CONST_2(n) \
+    ((n) >= (1ULL << 2) ? 2 + __LOG2_CONST_1((n) >> 2) : __LOG2_CONST_1(n))
+#define __LOG2_CONST_4(n) \
+    ((n) >= (1ULL << 4) ? 4 + __LOG2_CONST_2((n) >> 4) : __LOG2_CONST_2(n))
+#define __LOG2_CONST_8(n) \
+    ((n) >= (1ULL << 8) ? 8 + __LOG2_CONST_4((n) >> 8) : __LOG2_CONST_4(n))
+#define __LOG2_CONST_16(n)                                             \
+    ((n) >= (1ULL << 16) ? 16 + __LOG2_CONST_8((n) >> 16) \
+                         : __LOG2_CONST_8(n))
+#define __LOG2_CONST_32(n)                                               \
+    ((n) >= (1ULL << 32) ? 32 + __LOG2_CONST_16((n) >> 32) \
+                         : __LOG2_CONST_16(n))
+
+/**
+ * FLOOR_LOG2_CONST() - floor(log2(n)) as a constant expression
+ * @n: constant value, 0 gives 0
+ */
+#define FLOOR_LOG2_CONST(n) ((int) __LOG2_CONST_32((unsigned long long) (n)))
+
+/**
+ * CEIL_LOG2_CONST() - ceil(log2(n)) as a constant expression
+ * @n: constant value, 0 and 1 give 0
+ */
+#define CEIL_LOG2_CONST(n) \
+    ((n) <= 1 ? 0 : FLOOR_LOG2_CONST((unsigned long long) (n) - 1) + 1)
+
+/**
+ * floor_log2_64_table() - floor(log2(v)) through a lookup table
+ * @v: value, must not be 0
+ *
+ * Return: position of the highest set bit of @v
+ */
+static inline int floor_log2_64_table(uint64_t v)
+{
+    static const char log_table_256[256] = {
+#define _(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+        -1,   0,    1,    1,    2,    2,    2,    2,    3,    3,    3,
+        3,    3,    3,    3,    3,    _(4), _(5), _(5), _(6), _(6), _(6),
+        _(6), _(7), _(7), _(7), _(7), _(7), _(7), _(7), _(7),
+#undef _
+    };
+    unsigned r;
+    uint64_t t, tt, ttt;
+
+    ttt = v >> 32;
+    if (ttt) {
+        tt = ttt >> 16;
+        if (tt) {
+            t = tt >> 8;
+            if (t) {
+                r = 56 + log_table_256[t];
+            } else {
+                r = 48 + log_table_256[tt];
+            }
+        } else {
+            t = ttt >> 8;
+            if (t) {
+                r = 40 + log_table_256[t];
+            } else {
+                r = 32 + log_table_256[ttt];
+            }
+        }
+    } else {
+        tt = v >> 16;
+        if (tt) {
+            t = tt >> 8;
+            if (t) {
+                r = 24 + log_table_256[t];
+            } else {
+                r = 16 + log_table_256[tt];
+            }
+        } else {
+            t = v >> 8;
+            if (t) {
+                r = 8 + log_table_256[t];
+            } else {
+                r = 0 + log_table_256[v];
+            }
+        }
+    }
+    return r;
+}
+
+/**
+ * floor_log2_32_shift() - floor(log2(x)) through a branchless shift cascade
+ * @x: value, 0 gives 0
+ *
+ * Return: position of the highest set bit of @x
+ */
+static inline int floor_log2_32_shift(uint32_t x)
+{
+    uint32_t r, shift;
+
+    r = (x > 0xFFFF) << 4;
+    x >>= r;
+    shift = (x > 0xFF) << 3;
+    x >>= shift;
+    r |= shift;
+    shift = (x > 0xF) << 2;
+    x >>= shift;
+    r |= shift;
+    shift = (x > 0x3) << 1;
+    x >>= shift;
+    return r | shift | x >> 1;
+}
+
+/**
+ * ceil_log2_32_shift() - ceil(log2(x)) through a branchless shift cascade
+ * @x: value, 0 and 1 give 0
+ *
+ * Return: smallest b with (1 << b) >= @x
+ */
+static inline int ceil_log2_32_shift(uint32_t x)
+{
+    return (floor_log2_32_shift(x - 1) + 1) * (x > 1);
+}
+
+/**
+ * floor_log2_32() - floor(log2(x))
+ * @x: value, must not be 0
+ *
+ * Return: position of the highest set bit of @x
+ */
+static inline int floor_log2_32(uint32_t x)
+{
+#ifdef HAVE_BUILTIN_CLZ
+    return 31 ^ __builtin_clz(x);
+#else
+    return floor_log2_32_shift(x);
+#endif
+}
+
+/**
+ * floor_log2_64() - floor(log2(x))
+ * @x: value, must not be 0
+ *
+ * Return: position of the highest set bit of @x
+ */
+static inline int floor_log2_64(uint64_t x)
+{
+#ifdef HAVE_BUILTIN_CLZ
+    return 63 ^ __builtin_clzll(x);
+#else
+    return floor_log2_64_table(x);
+#endif
+}
+
+/**
+ * ceil_log2_32() - ceil(log2(x))
+ * @x: value, 0 and 1 give 0
+ *
+ * Return: smallest b with (1 << b) >= @x
+ */
+static inline int ceil_log2_32(uint32_t x)
+{
+#ifdef HAVE_BUILTIN_CLZ
+    return x > 1 ? 32 - __builtin_clz(x - 1) : 0;
+#else
+    return ceil_log2_32_shift(x);
+#endif
+}
+
+/**
+ * ceil_log2_64() - ceil(log2(x))
+ * @x: value, 0 and 1 give 0
+ *
+ * Return: smallest b with (1 << b) >= @x
+ */
+static inline int ceil_log2_64(uint64_t x)
+{
+#ifdef HAVE_BUILTIN_CLZ
+    return x > 1 ? 64 - __builtin_clzll(x - 1) : 0;
+#else
+    return x > 1 ? floor_log2_64_table(x - 1) + 1 : 0;
+#endif
+}
+
+/* Defines name(in, out, n), out[i] = fn(in[i]), with a LZCNT version picked
+ * at the first call where the CPU supports it
+ */
+#ifdef HAVE_LZCNT_DISPATCH
+#define __DEFINE_LOG2_BATCH(name, type, fn)                                  \
+    static inline void name##_generic(const type *in, uint8_t *out,          \
+                                      size_t n)                              \
+    {                                                                        \
+        for (size_t i = 0; i < n; i++)                                       \
+            out[i] = fn(in[i]);                                              \
+    }                                                                        \
+    __attribute__((target("lzcnt"))) static inline void name##_lzcnt(        \
+        const type *in, uint8_t *out, size_t n)                              \
+    {                                                                        \
+        for (size_t i = 0; i < n; i++)                                       \
+            out[i] = fn(in[i]);                                              \
+    }                                                                        \
+    static inline void name(const type *in, uint8_t *out, size_t n)          \
+    {                                                                        \
+        static void (*impl)(const type *, uint8_t *, size_t);                \
+                                                                             \
+        if (!impl) {                                                         \
+            __builtin_cpu_init();                                            \
+            impl = __builtin_cpu_supports("lzcnt") ? name##_lzcnt            \
+                                                   : name##_generic;         \
+        }                                                                    \
+        impl(in, out, n);                                                    \
+    }
+#else
+#define __DEFINE_LOG2_BATCH(name, type, fn)                                  \
+    static inline void name(const type *in, uint8_t *out, size_t n)          \
+    {                                                                        \
+        for (size_t i = 0; i < n; i++)                                       \
+            out[i] = fn(in[i]);                                              \
+    }
+#endif
+
+/**
+ * floor_log2_32_batch() - floor_log2_32 of every element of an array
+ * @in: values, none of them 0
+ * @out: results, out[i] for in[i]
+ * @n: number of elements
+ */
+__DEFINE_LOG2_BATCH(floor_log2_32_batch, uint32_t, floor_log2_32)
+
+/**
+ * floor_log2_64_batch() - floor_log2_64 of every element of an array
+ * @in: values, none of them 0
+ * @out: results, out[i] for in[i]
+ * @n: number of elements
+ */
+__DEFINE_LOG2_BATCH(floor_log2_64_batch, uint64_t, floor_log2_64)
+
+/**
+ * ceil_log2_32_batch() - ceil_log2_32 of every element of an array
+ * @in: values
+ * @out: results, out[i] for in[i]
+ * @n: number of elements
+ */
+__DEFINE_LOG2_BATCH(ceil_log2_32_batch, uint32_t, ceil_log2_32)
+
+/**
+ * ceil_log2_64_batch() - ceil_log2_64 of every element of an array
+ * @in: values
+ * @out: results, out[i] for in[i]
+ * @n: number of elements
+ */
+__DEFINE_LOG2_BATCH(ceil_log2_64_batch, uint64_t, ceil_log2_64)
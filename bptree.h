@@ -0,0 +1,511 @@
+#pragma once
+
+/*
+ * B+-tree ordered map with int64_t keys
+ *
+ * Every node keeps up to BPTREE_ORDER sorted keys in one array aligned to a
+ * cache line, so a lookup loads a few adjacent cache lines per level instead
+ * of one cache miss per key comparison as in a binary tree. With the default
+ * order of 32 a tree of 10^9 keys is 7 levels deep, a red-black tree about 30.
+ *
+ * The position of a key inside a node is the number of keys in the node which
+ * are smaller. It is counted over the whole array without branches, with AVX2
+ * when the CPU has it. Unused slots hold BPTREE_KEY_PAD, which is never
+ * smaller than a key, so the count needs no bound.
+ *
+ * Inner nodes hold nkeys separators and nkeys + 1 children. Child i holds the
+ * keys in (keys[i - 1], keys[i]], the separator is the largest key of the
+ * left part at the time of the split. All values live in the leaves, which are
+ * linked in key order for iteration.
+ *
+ * Keys are unique. Erasing is not supported.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH 1
+#endif
+
+#ifndef BPTREE_ORDER
+#define BPTREE_ORDER 32 /* keys per node, 4 cache lines */
+#endif
+
+_Static_assert(BPTREE_ORDER >= 4 && BPTREE_ORDER % 4 == 0,
+               "BPTREE_ORDER must be a multiple of 4");
+
+#define BPTREE_MAX_HEIGHT 32 /* 2^31 leaves even with BPTREE_ORDER 4 */
+#define BPTREE_KEY_PAD INT64_MAX
+
+struct bptree_node {
+    int64_t keys[BPTREE_ORDER];
+    unsigned int nkeys;
+} __attribute__((aligned(64)));
+
+struct bptree_leaf {
+    struct bptree_node node;
+    struct bptree_leaf *next;
+    void *values[BPTREE_ORDER];
+};
+
+struct bptree_inner {
+    struct bptree_node node;
+    struct bptree_node *children[BPTREE_ORDER + 1];
+};
+
+/**
+ * struct bptree - root of a B+-tree
+ * @root: top node, a leaf when @height is 1
+ * @first: leftmost leaf, the start of the leaf list
+ * @size: number of keys
+ * @height: number of levels, 0 for an empty tree
+ */
+struct bptree {
+    struct bptree_node *root;
+    struct bptree_leaf *first;
+    size_t size;
+    unsigned int height;
+};
+
+/**
+ * struct bptree_iter - position in a B+-tree
+ * @leaf: current leaf, NULL at the end
+ * @pos: index of the current key in @leaf
+ */
+struct bptree_iter {
+    struct bptree_leaf *leaf;
+    unsigned int pos;
+};
+
+#ifdef HAVE_AVX2_DISPATCH
+static bool bptree_has_avx2;
+#endif
+
+static inline unsigned int bptree_rank_generic(const int64_t *keys,
+                                               int64_t key)
+{
+    unsigned int rank = 0;
+
+    for (unsigned int i = 0; i < BPTREE_ORDER; i++)
+        rank += keys[i] < key;
+    return rank;
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+/* The compare results are -1 per smaller key, summed up in four lanes */
+__attribute__((target("avx2"))) static unsigned int bptree_rank_avx2(
+    const int64_t *keys,
+    int64_t key)
+{
+    __m256i k = _mm256_set1_epi64x(key), sum = _mm256_setzero_si256();
+    __m128i s;
+
+    for (unsigned int i = 0; i < BPTREE_ORDER; i += 4) {
+        __m256i v = _mm256_load_si256((const __m256i *) (keys + i));
+        sum = _mm256_sub_epi64(sum, _mm256_cmpgt_epi64(k, v));
+    }
+    s = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                      _mm256_extracti128_si256(sum, 1));
+    return _mm_cvtsi128_si64(_mm_add_epi64(s, _mm_unpackhi_epi64(s, s)));
+}
+#endif
+
+/* Number of keys in @node which are smaller than @key */
+static inline unsigned int bptree_rank(const struct bptree_node *node,
+                                       int64_t key)
+{
+#ifdef HAVE_AVX2_DISPATCH
+    if (bptree_has_avx2)
+        return bptree_rank_avx2(node->keys, key);
+#endif
+    return bptree_rank_generic(node->keys, key);
+}
+
+static inline void *bptree_alloc_node(size_t size)
+{
+    struct bptree_node *node = aligned_alloc(64, size);
+
+    if (node) {
+        for (unsigned int i = 0; i < BPTREE_ORDER; i++)
+            node->keys[i] = BPTREE_KEY_PAD;
+        node->nkeys = 0;
+    }
+    return node;
+}
+
+/**
+ * bptree_init() - Initialize an empty B+-tree
+ * @tree: tree to initialize
+ */
+static inline void bptree_init(struct bptree *tree)
+{
+    *tree = (struct bptree){NULL, NULL, 0, 0};
+#ifdef HAVE_AVX2_DISPATCH
+    __builtin_cpu_init();
+    bptree_has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+static inline void bptree_free_node(struct bptree_node *node,
+                                    unsigned int height)
+{
+    if (height > 1) {
+        struct bptree_inner *inner = (struct bptree_inner *) node;
+
+        for (unsigned int i = 0; i <= node->nkeys; i++)
+            bptree_free_node(inner->children[i], height - 1);
+    }
+    free(node);
+}
+
+/**
+ * bptree_destroy() - Free all nodes of a B+-tree
+ * @tree: tree to destroy, it is empty afterwards
+ *
+ * The values are not touched.
+ */
+static inline void bptree_destroy(struct bptree *tree)
+{
+    if (tree->root)
+        bptree_free_node(tree->root, tree->height);
+    tree->root = NULL;
+    tree->first = NULL;
+    tree->size = 0;
+    tree->height = 0;
+}
+
+/* Descend to the leaf which holds @key or would hold it */
+static inline struct bptree_leaf *bptree_find_leaf(const struct bptree *tree,
+                                                   int64_t key)
+{
+    struct bptree_node *node = tree->root;
+
+    for (unsigned int h = tree->height; h > 1; h--) {
+        unsigned int i = bptree_rank(node, key);
+
+        node = ((struct bptree_inner *) node)->children[i];
+    }
+    return (struct bptree_leaf *) node;
+}
+
+/**
+ * bptree_find() - Look up a key
+ * @tree: tree to search
+ * @key: key to look for
+ *
+ * Return: pointer to the value stored for @key, NULL when it is not in the tree
+ */
+static inline void **bptree_find(const struct bptree *tree, int64_t key)
+{
+    struct bptree_leaf *leaf;
+    unsigned int pos;
+
+    if (!tree->root)
+        return NULL;
+    leaf = bptree_find_leaf(tree, key);
+    pos = bptree_rank(&leaf->node, key);
+    if (pos < leaf->node.nkeys && leaf->node.keys[pos] == key)
+        return &leaf->values[pos];
+    return NULL;
+}
+
+/* Skip to the next leaf when @it is past the end of its leaf */
+static inline void bptree_iter_settle(struct bptree_iter *it)
+{
+    while (it->leaf && it->pos >= it->leaf->node.nkeys) {
+        it->leaf = it->leaf->next;
+        it->pos = 0;
+    }
+}
+
+/**
+ * bptree_first() - Position an iterator on the smallest key
+ * @tree: tree to iterate
+ * @it: iterator, it->leaf is NULL when the tree is empty
+ */
+static inline void bptree_first(const struct bptree *tree,
+                                struct bptree_iter *it)
+{
+    it->leaf = tree->first;
+    it->pos = 0;
+    bptree_iter_settle(it);
+}
+
+/**
+ * bptree_lower_bound() - Position an iterator on the first key not smaller
+ *  than @key
+ * @tree: tree to search
+ * @key: key to look for
+ * @it: iterator, it->leaf is NULL when all keys are smaller
+ */
+static inline void bptree_lower_bound(const struct bptree *tree,
+                                      int64_t key,
+                                      struct bptree_iter *it)
+{
+    it->leaf = tree->root ? bptree_find_leaf(tree, key) : NULL;
+    it->pos = it->leaf ? bptree_rank(&it->leaf->node, key) : 0;
+    bptree_iter_settle(it);
+}
+
+/**
+ * bptree_iter_next() - Advance an iterator to the next larger key
+ * @it: valid iterator
+ */
+static inline void bptree_iter_next(struct bptree_iter *it)
+{
+    it->pos++;
+    bptree_iter_settle(it);
+}
+
+#define bptree_iter_key(it) ((it)->leaf->node.keys[(it)->pos])
+#define bptree_iter_value(it) ((it)->leaf->values[(it)->pos])
+
+/**
+ * bptree_for_each() - Iterate over all keys in ascending order
+ * @it: struct bptree_iter to use as loop cursor
+ * @tree: tree to iterate
+ */
+#define bptree_for_each(it, tree) \
+    for (bptree_first(tree, &(it)); (it).leaf; bptree_iter_next(&(it)))
+
+/* Insert @key and @value at @pos of a leaf with free room */
+static inline void bptree_leaf_put(struct bptree_leaf *leaf,
+                                   unsigned int pos,
+                                   int64_t key,
+                                   void *value)
+{
+    unsigned int n = leaf->node.nkeys - pos;
+
+    memmove(&leaf->node.keys[pos + 1], &leaf->node.keys[pos],
+            n * sizeof(int64_t));
+    memmove(&leaf->values[pos + 1], &leaf->values[pos], n * sizeof(void *));
+    leaf->node.keys[pos] = key;
+    leaf->values[pos] = value;
+    leaf->node.nkeys++;
+}
+
+/* Insert separator @key and its right child at @pos of an inner node with
+ * free room
+ */
+static inline void bptree_inner_put(struct bptree_inner *inner,
+                                    unsigned int pos,
+                                    int64_t key,
+                                    struct bptree_node *right)
+{
+    unsigned int n = inner->node.nkeys - pos;
+
+    memmove(&inner->node.keys[pos + 1], &inner->node.keys[pos],
+            n * sizeof(int64_t));
+    memmove(&inner->children[pos + 2], &inner->children[pos + 1],
+            n * sizeof(void *));
+    inner->node.keys[pos] = key;
+    inner->children[pos + 1] = right;
+    inner->node.nkeys++;
+}
+
+/* Move the upper half of a full node into @right, which is empty */
+static inline void bptree_split_keys(struct bptree_node *left,
+                                     struct bptree_node *right,
+                                     unsigned int keep)
+{
+    right->nkeys = BPTREE_ORDER - keep;
+    memcpy(right->keys, &left->keys[keep], right->nkeys * sizeof(int64_t));
+    for (unsigned int i = keep; i < BPTREE_ORDER; i++)
+        left->keys[i] = BPTREE_KEY_PAD;
+    left->nkeys = keep;
+}
+
+/**
+ * bptree_insert() - Insert a key with its value
+ * @tree: tree to insert into
+ * @key: key, must be smaller than BPTREE_KEY_PAD
+ * @value: value stored for @key
+ *
+ * Full nodes on the path are split in half from the leaf upwards, a split of
+ * the root adds a level.
+ *
+ * Return: 0 on success, -1 with errno EEXIST when @key is already in the tree
+ *  or ENOMEM when a node cannot be allocated. The tree is unchanged on error.
+ */
+static inline int bptree_insert(struct bptree *tree, int64_t key, void *value)
+{
+    struct bptree_inner *path[BPTREE_MAX_HEIGHT + 1];
+    struct bptree_inner *spare[BPTREE_MAX_HEIGHT + 1];
+    unsigned int idx[BPTREE_MAX_HEIGHT + 1];
+    struct bptree_node *node = tree->root, *right;
+    struct bptree_leaf *leaf, *sibling;
+    unsigned int pos, h, nspare;
+    int64_t sep;
+    bool ok;
+
+    if (!node) {
+        leaf = bptree_alloc_node(sizeof(*leaf));
+        if (!leaf) {
+            errno = ENOMEM;
+            return -1;
+        }
+        leaf->next = NULL;
+        tree->root = &leaf->node;
+        tree->first = leaf;
+        tree->height = 1;
+        node = tree->root;
+    }
+
+    for (h = tree->height; h > 1; h--) {
+        path[h] = (struct bptree_inner *) node;
+        idx[h] = bptree_rank(node, key);
+        node = path[h]->children[idx[h]];
+    }
+
+    leaf = (struct bptree_leaf *) node;
+    pos = bptree_rank(node, key);
+    if (pos < node->nkeys && node->keys[pos] == key) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (node->nkeys < BPTREE_ORDER) {
+        bptree_leaf_put(leaf, pos, key, value);
+        tree->size++;
+        return 0;
+    }
+
+    /* Allocate the nodes for all splits first, so a failure changes nothing.
+     * Inner nodes split as long as they are full, the root also needs a new
+     * parent.
+     */
+    sibling = bptree_alloc_node(sizeof(*sibling));
+    ok = sibling;
+    for (nspare = 0, h = 2; ok && h <= tree->height + 1; h++) {
+        if (h <= tree->height && path[h]->node.nkeys < BPTREE_ORDER)
+            break;
+        spare[nspare] = bptree_alloc_node(sizeof(struct bptree_inner));
+        ok = spare[nspare];
+        nspare += ok;
+    }
+    if (!ok) {
+        while (nspare)
+            free(spare[--nspare]);
+        free(sibling);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(sibling->values, &leaf->values[BPTREE_ORDER / 2],
+           BPTREE_ORDER / 2 * sizeof(void *));
+    bptree_split_keys(node, &sibling->node, BPTREE_ORDER / 2);
+    sibling->next = leaf->next;
+    leaf->next = sibling;
+    if (pos <= BPTREE_ORDER / 2)
+        bptree_leaf_put(leaf, pos, key, value);
+    else
+        bptree_leaf_put(sibling, pos - BPTREE_ORDER / 2, key, value);
+    tree->size++;
+    sep = node->keys[node->nkeys - 1];
+    right = &sibling->node;
+
+    /* Push the separator up, splitting full inner nodes on the way */
+    for (h = 2; h <= tree->height; h++) {
+        struct bptree_inner *inner = path[h], *split;
+        unsigned int keep = BPTREE_ORDER / 2;
+        int64_t up;
+
+        pos = idx[h];
+        if (inner->node.nkeys < BPTREE_ORDER) {
+            bptree_inner_put(inner, pos, sep, right);
+            return 0;
+        }
+
+        split = spare[h - 2];
+        /* The key at @keep moves up, unless the new one falls right there */
+        if (pos < keep)
+            keep--;
+        up = inner->node.keys[keep];
+        memcpy(split->children, &inner->children[keep + 1],
+               (BPTREE_ORDER - keep) * sizeof(void *));
+        bptree_split_keys(&inner->node, &split->node, keep + 1);
+        inner->node.nkeys = keep;
+        inner->node.keys[keep] = BPTREE_KEY_PAD;
+        if (pos <= keep)
+            bptree_inner_put(inner, pos, sep, right);
+        else
+            bptree_inner_put(split, pos - keep - 1, sep, right);
+        sep = up;
+        right = &split->node;
+    }
+
+    /* The root was split */
+    struct bptree_inner *root = spare[h - 2];
+
+    root->node.keys[0] = sep;
+    root->node.nkeys = 1;
+    root->children[0] = tree->root;
+    root->children[1] = right;
+    tree->root = &root->node;
+    tree->height++;
+    return 0;
+}
+
+static inline bool bptree_verify_node(const struct bptree_node *node,
+                                      unsigned int height,
+                                      const int64_t *lo,
+                                      const int64_t *hi,
+                                      size_t *count)
+{
+    const struct bptree_inner *inner = (const struct bptree_inner *) node;
+
+    if (node->nkeys > BPTREE_ORDER || (height > 1 && !node->nkeys))
+        return false;
+    for (unsigned int i = 0; i < BPTREE_ORDER; i++) {
+        if (i >= node->nkeys) {
+            if (node->keys[i] != BPTREE_KEY_PAD)
+                return false;
+        } else if ((i && node->keys[i - 1] >= node->keys[i]) ||
+                   (lo && node->keys[i] <= *lo) ||
+                   (hi && node->keys[i] > *hi)) {
+            return false;
+        }
+    }
+
+    if (height == 1) {
+        *count += node->nkeys;
+        return true;
+    }
+    for (unsigned int i = 0; i <= node->nkeys; i++) {
+        if (!bptree_verify_node(inner->children[i], height - 1,
+                                i ? &node->keys[i - 1] : lo,
+                                i < node->nkeys ? &node->keys[i] : hi, count))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * bptree_verify() - Check the order, the key bounds of every subtree and the
+ *  leaf list of a B+-tree
+ * @tree: tree to check
+ *
+ * Return: true when the tree is valid
+ */
+static inline bool bptree_verify(const struct bptree *tree)
+{
+    struct bptree_iter it;
+    size_t count = 0, listed = 0;
+    int64_t prev = 0;
+
+    if (!tree->root)
+        return !tree->size && !tree->height && !tree->first;
+    if (!bptree_verify_node(tree->root, tree->height, NULL, NULL, &count))
+        return false;
+
+    bptree_for_each(it, tree) {
+        if (listed++ && bptree_iter_key(&it) <= prev)
+            return false;
+        prev = bptree_iter_key(&it);
+    }
+    return count == tree->size && listed == tree->size;
+}
@@ -1,6 +1,20 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitmath.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 /* Implementation of LFSR (linear feedback shift register)
  * on uint64_t using irreducible polynomial x^64 + x^61 + x^34 + x^9 + 1
@@ -15,103 +29,259 @@ static void lfsr(uint64_t *up)
     /* shift *up by 1 to RIGHT and insert new_bit at "empty" position */
 }
 
-static unsigned int N_BUCKETS;
-static unsigned char N_BITS;
+/* The feedback of step j only reads bits j, j + 3, j + 30 and j + 55 of the
+ * state, so the first 64 - 55 = 9 new bits only depend on bits that are
+ * still the original ones. They can be computed with one word operation.
+ */
+#define LFSR_MAX_STRIDE 9
+
+/* Same as calling lfsr() n times */
+static inline void lfsr_n(uint64_t *up, unsigned int n)
+{
+    uint64_t x = *up;
+
+    while (n) {
+        unsigned int k = n < LFSR_MAX_STRIDE ? n : LFSR_MAX_STRIDE;
+        uint64_t new_bits =
+            (x ^ (x >> 3) ^ (x >> 30) ^ (x >> 55)) & ((1u << k) - 1);
 
-static const char log_table_256[256] = {
-#define _(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
-    -1,   0,    1,    1,    2,    2,    2,    2,    3,    3,    3,
-    3,    3,    3,    3,    3,    _(4), _(5), _(5), _(6), _(6), _(6),
-    _(6), _(7), _(7), _(7), _(7), _(7), _(7), _(7), _(7),
-#undef _
+        x = (x >> k) | (new_bits << (64 - k));
+        n -= k;
+    }
+
+    *up = x;
+}
+
+/* Everything derived from the number of buckets, computed once.
+ *
+ * A mapper is only read after initialization, so one object can be shared by
+ * any number of threads, and several bucket counts can be used at the same
+ * time.
+ */
+struct bucket_mapper {
+    unsigned int n_buckets;
+    unsigned char n_bits;    /* floor_log2_64(n_buckets) */
+    unsigned char lfsr_iter; /* LFSR steps per sample, 2 * n_bits */
+    uint64_t mask111;        /* n_bits + 1 low bits */
+    uint64_t mask011;        /* n_bits low bits, one 1 less */
+    uint64_t recip;          /* ceil(2^64 / n_buckets), for fastmod */
 };
 
-#undef _
+/* Static initializer for a bucket count known at compile time. The fields are
+ * integer constant expressions, so with the inline bucket_number and
+ * fill_buckets the compiler folds all masks and shifts into immediates.
+ */
+#define BUCKET_MAPPER_INIT(n)                                        \
+    {                                                                \
+        .n_buckets = (n), .n_bits = FLOOR_LOG2_CONST(n),             \
+        .lfsr_iter = 2 * FLOOR_LOG2_CONST(n),                        \
+        .mask111 = (UINT64_C(2) << FLOOR_LOG2_CONST(n)) - 1,         \
+        .mask011 = (UINT64_C(1) << FLOOR_LOG2_CONST(n)) - 1,         \
+        .recip = UINT64_C(0xFFFFFFFFFFFFFFFF) / (n) + 1,             \
+    }
 
-/* ASSUME x >= 1
- * returns smallest integer b such that 2^b = 1 << b is >= x
+/* n == number of totally available buckets, so buckets = \{0, ...,, n-1\}
+ * ASSUME 1 <= n < (1 << 32)
  */
-uint64_t log2_64(uint64_t v)
+void bucket_mapper_init(struct bucket_mapper *m, unsigned int n)
 {
-    unsigned r;
-    uint64_t t, tt, ttt;
+    m->n_buckets = n;
+    m->n_bits = floor_log2_64(n);
+    m->lfsr_iter = m->n_bits << 1;
+    m->mask111 = (UINT64_C(2) << m->n_bits) - 1;
+    m->mask011 = (UINT64_C(1) << m->n_bits) - 1;
+    m->recip = UINT64_C(0xFFFFFFFFFFFFFFFF) / n + 1;
+}
 
-    ttt = v >> 32;
-    if (ttt) {
-        tt = ttt >> 16;
-        if (tt) {
-            t = tt >> 8;
-            if (t) {
-                r = 56 + log_table_256[t]; // AAAA
-            } else {
-                r = 48 + log_table_256[tt]; // BBBB
-            }
-        } else {
-            t = ttt >> 8;
-            if (t) {
-                r = 40 + log_table_256[t]; // CCCC
-            } else {
-                r = 32 + log_table_256[ttt]; // DDDD
-            }
-        }
-    } else {
-        tt = v >> 16;
-        if (tt) {
-            t = tt >> 8;
-            if (t) {
-                r = 24 + log_table_256[t]; // EEEE
-            } else {
-                r = 16 + log_table_256[tt]; // FFFF
-            }
-        } else {
-            t = v >> 8;
-            if (t) {
-                r = 8 + log_table_256[t]; // GGGG
-            } else {
-                r = 0 + log_table_256[v]; // HHHH
-            }
+static inline unsigned int bucket_number(const struct bucket_mapper *m,
+                                         uint64_t x)
+{
+    unsigned char leq = ((x & m->mask111) < m->n_buckets);
+    /* leq (less or equal) is 0 or 1. */
+
+    return (leq * (x & m->mask111)) +
+           ((1 - leq) * ((x >> (m->n_bits + 1)) & m->mask011));
+    /* 'x >> (n_bits + 1)' : take different set of bits -> better uniformity.
+     * '... & mask011' guarantees that the result is less or equal n_buckets.
+     */
+}
+
+/* The LFSR is linear over GF(2), so stepping it n times is a 64x64 bit
+ * matrix. lfsr_jump() advances the state by an arbitrary number of steps in
+ * O(log n) matrix squarings. A matrix is stored by columns: col[i] is the
+ * image of the state with only bit i set.
+ */
+static uint64_t gf2_apply(const uint64_t *col, uint64_t x)
+{
+    uint64_t y = 0;
+
+    for (; x; x &= x - 1)
+        y ^= col[__builtin_ctzll(x)];
+
+    return y;
+}
+
+static uint64_t lfsr_jump(uint64_t x, uint64_t steps)
+{
+    uint64_t col[64], sq[64];
+
+    for (int i = 0; i < 64; i++) {
+        col[i] = 1ULL << i;
+        lfsr(&col[i]);
+    }
+
+    for (; steps; steps >>= 1) {
+        if (steps & 1)
+            x = gf2_apply(col, x);
+        if (steps > 1) {
+            for (int i = 0; i < 64; i++)
+                sq[i] = gf2_apply(col, col[i]);
+            memcpy(col, sq, sizeof(col));
         }
     }
-    return r;
+
+    return x;
 }
 
-void set_N_BUCKETS(unsigned int n)
+/* Alternative mappings from the LFSR state to a bucket
+ *
+ * bucket_number only looks at 2 * n_bits + 1 low bits and folds the values
+ * above n_buckets into a smaller window, which favors the low buckets. The
+ * mappers below use the low 32 bits of the state instead:
+ *
+ * - mulhi: floor(r * n_buckets / 2^32), one multiply, bias below
+ *   n_buckets / 2^32
+ * - fastmod: r % n_buckets through a precomputed reciprocal (Lemire, Kaser,
+ *   Kurz, "Faster remainder by direct computation"), same bias as mulhi
+ * - lemire: mulhi with rejection of the 2^32 % n_buckets values which cause
+ *   the bias (Lemire, "Fast random integer generation in an interval").
+ *   Unbiased, a rejected value advances the LFSR by 32 more steps, which
+ *   happens with probability below n_buckets / 2^32
+ *
+ * All take the state by reference because lemire may have to advance it.
+ * The 32 bit mappers advance the LFSR by 32 steps per sample instead of
+ * lfsr_iter, otherwise consecutive samples would share most of their bits.
+ */
+typedef unsigned int (*bucket_map_fn)(const struct bucket_mapper *m,
+                                      uint64_t *x);
+
+enum bucket_map {
+    BUCKET_MAP_WINDOW,
+    BUCKET_MAP_MULHI,
+    BUCKET_MAP_FASTMOD,
+    BUCKET_MAP_LEMIRE,
+    BUCKET_MAP_COUNT,
+};
+
+static unsigned int bucket_number_window(const struct bucket_mapper *m,
+                                         uint64_t *x)
 {
-    N_BUCKETS = n;
+    return bucket_number(m, *x);
 }
-void set_N_BITS()
+
+static unsigned int bucket_number_mulhi(const struct bucket_mapper *m,
+                                        uint64_t *x)
 {
-    N_BITS = log2_64(N_BUCKETS);
+    return ((uint64_t) (uint32_t) *x * m->n_buckets) >> 32;
 }
 
-/* n == number of totally available buckets, so buckets = \{0, ...,, n-1\}
- * ASSUME n < (1 << 32)
- */
-unsigned int bucket_number(uint64_t x)
+static unsigned int bucket_number_fastmod(const struct bucket_mapper *m,
+                                          uint64_t *x)
 {
-    uint64_t mask111 = (1 << (N_BITS + 1)) - 1;
-    uint64_t mask011 = (1 << (N_BITS)) - 1; /* one 1 less */
+    uint64_t low = m->recip * (uint32_t) *x;
 
-    unsigned char leq = ((x & mask111) < N_BUCKETS);
-    /* leq (less or equal) is 0 or 1. */
+    return ((__uint128_t) low * m->n_buckets) >> 64;
+}
 
-    return (leq * (x & mask111)) + // IIII
-           ((1 - leq) * ((x >> (N_BITS + 1)) & mask011)); // JJJJ
-    /* 'x >> (N_BITS + 1)' : take different set of bits -> better uniformity.
-     * '... & mask011' guarantees that the result is less or equal N_BUCKETS.
-     */
+static unsigned int bucket_number_lemire(const struct bucket_mapper *m,
+                                         uint64_t *x)
+{
+    uint64_t prod = (uint64_t) (uint32_t) *x * m->n_buckets;
+
+    if ((uint32_t) prod < m->n_buckets) {
+        uint32_t threshold = -m->n_buckets % m->n_buckets;
+
+        while ((uint32_t) prod < threshold) {
+            lfsr_n(x, 32);
+            prod = (uint64_t) (uint32_t) *x * m->n_buckets;
+        }
+    }
+
+    return prod >> 32;
 }
 
-void fill_buckets(unsigned int *buckets, unsigned int iterations)
+static const struct {
+    const char *name;
+    bucket_map_fn fn;
+    unsigned char steps; /* LFSR steps per sample, 0 for lfsr_iter */
+} bucket_mappers[BUCKET_MAP_COUNT] = {
+    [BUCKET_MAP_WINDOW] = {"window", bucket_number_window, 0},
+    [BUCKET_MAP_MULHI] = {"mulhi", bucket_number_mulhi, 32},
+    [BUCKET_MAP_FASTMOD] = {"fastmod", bucket_number_fastmod, 32},
+    [BUCKET_MAP_LEMIRE] = {"lemire", bucket_number_lemire, 32},
+};
+
+static inline unsigned int bucket_map_steps(const struct bucket_mapper *m,
+                                            enum bucket_map map)
+{
+    return bucket_mappers[map].steps ? bucket_mappers[map].steps
+                                     : m->lfsr_iter;
+}
+
+#define LFSR_SEED 0x98765421b16b00b5
+
+static inline void fill_buckets(const struct bucket_mapper *m,
+                                unsigned int *buckets,
+                                unsigned int iterations)
 {
-    uint64_t x = 0x98765421b16b00b5;
-    unsigned char lfsr_iter = (N_BITS << 1);
+    uint64_t x = LFSR_SEED;
+    unsigned char lfsr_iter = m->lfsr_iter;
 
     for (uint64_t i = 0; i < iterations; i++) {
-        unsigned int tmp_bucket = bucket_number(x);
+        unsigned int tmp_bucket = bucket_number(m, x);
         *(buckets + tmp_bucket) = *(buckets + tmp_bucket) + 1;
 
         // 'turn handle' on LFSR lfsr_iteration-times!
+        lfsr_n(&x, lfsr_iter);
+    }
+}
+
+/* Define @name as fill_buckets for a bucket count fixed at compile time */
+#define DEFINE_FILL_BUCKETS_CONST(name, n)                                 \
+    void name(unsigned int *buckets, unsigned int iterations)             \
+    {                                                                      \
+        static const struct bucket_mapper __m = BUCKET_MAPPER_INIT(n);     \
+        fill_buckets(&__m, buckets, iterations);                           \
+    }
+
+/* fill_buckets with a selectable mapper */
+void fill_buckets_map(const struct bucket_mapper *m,
+                      unsigned int *buckets,
+                      unsigned int iterations,
+                      enum bucket_map map)
+{
+    bucket_map_fn fn = bucket_mappers[map].fn;
+    uint64_t x = LFSR_SEED;
+    unsigned int lfsr_iter = bucket_map_steps(m, map);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        buckets[fn(m, &x)]++;
+        lfsr_n(&x, lfsr_iter);
+    }
+}
+
+/* Bit at a time version of fill_buckets, kept as reference */
+static void fill_buckets_bitwise(const struct bucket_mapper *m,
+                                 unsigned int *buckets,
+                                 unsigned int iterations)
+{
+    uint64_t x = LFSR_SEED;
+    unsigned char lfsr_iter = m->lfsr_iter;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        unsigned int tmp_bucket = bucket_number(m, x);
+        *(buckets + tmp_bucket) = *(buckets + tmp_bucket) + 1;
+
         unsigned char ell = 0;
         while (ell < lfsr_iter) {
             lfsr(&x);
@@ -120,34 +290,951 @@ void fill_buckets(unsigned int *buckets, unsigned int iterations)
     }
 }
 
-void evaluate_buckets(unsigned int *buckets)
+/* Multi-stream generator
+ *
+ * bucket_streams() runs @nstreams independent LFSR streams, one per seed in
+ * @states, and writes @rounds bucket numbers of each: out[r * nstreams + s]
+ * is the r-th bucket of stream s. @states is advanced, so long sequences can
+ * be produced in chunks. Every stream gives exactly the buckets fill_buckets
+ * would produce when started from the same seed.
+ *
+ * The SIMD versions run 2 (SSE2), 4 (AVX2) or 8 (AVX-512) streams in the
+ * lanes of one register. The best one supported by the CPU is picked once,
+ * by the first call.
+ * Seeds must not be 0, which is a fixed point of the LFSR.
+ */
+typedef void (*bucket_streams_fn)(const struct bucket_mapper *m,
+                                  unsigned int *out,
+                                  unsigned int rounds,
+                                  uint64_t *states,
+                                  unsigned int nstreams);
+
+/* streams @first .. @nstreams - 1 one at a time */
+static void bucket_streams_tail(const struct bucket_mapper *m,
+                                unsigned int *out,
+                                unsigned int rounds,
+                                uint64_t *states,
+                                unsigned int first,
+                                unsigned int nstreams)
+{
+    unsigned char lfsr_iter = m->lfsr_iter;
+
+    for (unsigned int s = first; s < nstreams; s++) {
+        uint64_t x = states[s];
+
+        for (unsigned int r = 0; r < rounds; r++) {
+            out[r * nstreams + s] = bucket_number(m, x);
+            lfsr_n(&x, lfsr_iter);
+        }
+        states[s] = x;
+    }
+}
+
+static void bucket_streams_scalar(const struct bucket_mapper *m,
+                                  unsigned int *out,
+                                  unsigned int rounds,
+                                  uint64_t *states,
+                                  unsigned int nstreams)
+{
+    bucket_streams_tail(m, out, rounds, states, 0, nstreams);
+}
+
+#ifdef HAVE_X86_SIMD
+/* lfsr_n on every lane. Full strides use immediate shifts, only the last
+ * one needs a shift by register.
+ */
+__attribute__((target("sse2"))) static inline __m128i lfsr_n_sse2(
+    __m128i x,
+    unsigned int n)
+{
+    __m128i fb;
+
+    for (; n >= LFSR_MAX_STRIDE; n -= LFSR_MAX_STRIDE) {
+        fb = _mm_xor_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 3)),
+                           _mm_xor_si128(_mm_srli_epi64(x, 30),
+                                         _mm_srli_epi64(x, 55)));
+        fb = _mm_and_si128(fb, _mm_set1_epi64x((1u << LFSR_MAX_STRIDE) - 1));
+        x = _mm_or_si128(_mm_srli_epi64(x, LFSR_MAX_STRIDE),
+                         _mm_slli_epi64(fb, 64 - LFSR_MAX_STRIDE));
+    }
+
+    if (n) {
+        fb = _mm_xor_si128(_mm_xor_si128(x, _mm_srli_epi64(x, 3)),
+                           _mm_xor_si128(_mm_srli_epi64(x, 30),
+                                         _mm_srli_epi64(x, 55)));
+        fb = _mm_and_si128(fb, _mm_set1_epi64x((1u << n) - 1));
+        x = _mm_or_si128(_mm_srl_epi64(x, _mm_cvtsi32_si128(n)),
+                         _mm_sll_epi64(fb, _mm_cvtsi32_si128(64 - n)));
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2"))) static inline __m256i lfsr_n_avx2(
+    __m256i x,
+    unsigned int n)
+{
+    __m256i fb;
+
+    for (; n >= LFSR_MAX_STRIDE; n -= LFSR_MAX_STRIDE) {
+        fb = _mm256_xor_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 3)),
+                              _mm256_xor_si256(_mm256_srli_epi64(x, 30),
+                                               _mm256_srli_epi64(x, 55)));
+        fb = _mm256_and_si256(
+            fb, _mm256_set1_epi64x((1u << LFSR_MAX_STRIDE) - 1));
+        x = _mm256_or_si256(_mm256_srli_epi64(x, LFSR_MAX_STRIDE),
+                            _mm256_slli_epi64(fb, 64 - LFSR_MAX_STRIDE));
+    }
+
+    if (n) {
+        fb = _mm256_xor_si256(_mm256_xor_si256(x, _mm256_srli_epi64(x, 3)),
+                              _mm256_xor_si256(_mm256_srli_epi64(x, 30),
+                                               _mm256_srli_epi64(x, 55)));
+        fb = _mm256_and_si256(fb, _mm256_set1_epi64x((1u << n) - 1));
+        x = _mm256_or_si256(_mm256_srl_epi64(x, _mm_cvtsi32_si128(n)),
+                            _mm256_sll_epi64(fb, _mm_cvtsi32_si128(64 - n)));
+    }
+
+    return x;
+}
+
+__attribute__((target("avx512f"))) static inline __m512i lfsr_n_avx512(
+    __m512i x,
+    unsigned int n)
+{
+    __m512i fb;
+
+    for (; n >= LFSR_MAX_STRIDE; n -= LFSR_MAX_STRIDE) {
+        fb = _mm512_xor_si512(_mm512_xor_si512(x, _mm512_srli_epi64(x, 3)),
+                              _mm512_xor_si512(_mm512_srli_epi64(x, 30),
+                                               _mm512_srli_epi64(x, 55)));
+        fb = _mm512_and_si512(fb,
+                              _mm512_set1_epi64((1u << LFSR_MAX_STRIDE) - 1));
+        x = _mm512_or_si512(_mm512_srli_epi64(x, LFSR_MAX_STRIDE),
+                            _mm512_slli_epi64(fb, 64 - LFSR_MAX_STRIDE));
+    }
+
+    if (n) {
+        fb = _mm512_xor_si512(_mm512_xor_si512(x, _mm512_srli_epi64(x, 3)),
+                              _mm512_xor_si512(_mm512_srli_epi64(x, 30),
+                                               _mm512_srli_epi64(x, 55)));
+        fb = _mm512_and_si512(fb, _mm512_set1_epi64((1u << n) - 1));
+        x = _mm512_or_si512(_mm512_srl_epi64(x, _mm_cvtsi32_si128(n)),
+                            _mm512_sll_epi64(fb, _mm_cvtsi32_si128(64 - n)));
+    }
+
+    return x;
+}
+
+__attribute__((target("sse2"))) static void bucket_streams_sse2(
+    const struct bucket_mapper *m,
+    unsigned int *out,
+    unsigned int rounds,
+    uint64_t *states,
+    unsigned int nstreams)
+{
+    unsigned int lfsr_iter = m->lfsr_iter;
+    unsigned int groups = nstreams / 2;
+    const __m128i mask111 = _mm_set1_epi64x(m->mask111);
+    const __m128i mask011 = _mm_set1_epi64x(m->mask011);
+    const __m128i sign = _mm_set1_epi32(INT32_MIN);
+    const __m128i n_buckets = _mm_xor_si128(_mm_set1_epi32(m->n_buckets), sign);
+    const __m128i high_shift = _mm_cvtsi32_si128(m->n_bits + 1);
+
+    for (unsigned int g = 0; g < groups; g++) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (states + g * 2));
+
+        for (unsigned int r = 0; r < rounds; r++) {
+            /* SSE2 has no 64 bit compare. The masked values are below 2^32,
+             * so compare the low halves, unsigned by flipping the sign bit.
+             */
+            __m128i low = _mm_and_si128(x, mask111);
+            __m128i high =
+                _mm_and_si128(_mm_srl_epi64(x, high_shift), mask011);
+            __m128i leq =
+                _mm_cmpgt_epi32(n_buckets, _mm_xor_si128(low, sign));
+            __m128i bucket = _mm_or_si128(_mm_and_si128(leq, low),
+                                          _mm_andnot_si128(leq, high));
+
+            bucket = _mm_shuffle_epi32(bucket, _MM_SHUFFLE(2, 0, 2, 0));
+            _mm_storel_epi64((__m128i *) (out + r * nstreams + g * 2),
+                             bucket);
+
+            x = lfsr_n_sse2(x, lfsr_iter);
+        }
+
+        _mm_storeu_si128((__m128i *) (states + g * 2), x);
+    }
+
+    bucket_streams_tail(m, out, rounds, states, groups * 2, nstreams);
+}
+
+__attribute__((target("avx2"))) static void bucket_streams_avx2(
+    const struct bucket_mapper *m,
+    unsigned int *out,
+    unsigned int rounds,
+    uint64_t *states,
+    unsigned int nstreams)
+{
+    unsigned int lfsr_iter = m->lfsr_iter;
+    unsigned int groups = nstreams / 4;
+    const __m256i mask111 = _mm256_set1_epi64x(m->mask111);
+    const __m256i mask011 = _mm256_set1_epi64x(m->mask011);
+    const __m256i n_buckets = _mm256_set1_epi64x(m->n_buckets);
+    const __m128i high_shift = _mm_cvtsi32_si128(m->n_bits + 1);
+    const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+
+    for (unsigned int g = 0; g < groups; g++) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (states + g * 4));
+
+        for (unsigned int r = 0; r < rounds; r++) {
+            /* bucket_number, the masked values are below 2^32, so the
+             * signed compare is fine
+             */
+            __m256i low = _mm256_and_si256(x, mask111);
+            __m256i high =
+                _mm256_and_si256(_mm256_srl_epi64(x, high_shift), mask011);
+            __m256i leq = _mm256_cmpgt_epi64(n_buckets, low);
+            __m256i bucket = _mm256_blendv_epi8(high, low, leq);
+
+            bucket = _mm256_permutevar8x32_epi32(bucket, pack);
+            _mm_storeu_si128((__m128i *) (out + r * nstreams + g * 4),
+                             _mm256_castsi256_si128(bucket));
+
+            x = lfsr_n_avx2(x, lfsr_iter);
+        }
+
+        _mm256_storeu_si256((__m256i *) (states + g * 4), x);
+    }
+
+    bucket_streams_tail(m, out, rounds, states, groups * 4, nstreams);
+}
+
+__attribute__((target("avx512f"))) static void bucket_streams_avx512(
+    const struct bucket_mapper *m,
+    unsigned int *out,
+    unsigned int rounds,
+    uint64_t *states,
+    unsigned int nstreams)
+{
+    unsigned int lfsr_iter = m->lfsr_iter;
+    unsigned int groups = nstreams / 8;
+    const __m512i mask111 = _mm512_set1_epi64(m->mask111);
+    const __m512i mask011 = _mm512_set1_epi64(m->mask011);
+    const __m512i n_buckets = _mm512_set1_epi64(m->n_buckets);
+    const __m128i high_shift = _mm_cvtsi32_si128(m->n_bits + 1);
+
+    for (unsigned int g = 0; g < groups; g++) {
+        __m512i x = _mm512_loadu_si512(states + g * 8);
+
+        for (unsigned int r = 0; r < rounds; r++) {
+            __m512i low = _mm512_and_si512(x, mask111);
+            __m512i high = _mm512_and_si512(
+                _mm512_srl_epi64(x, high_shift), mask011);
+            __mmask8 leq = _mm512_cmplt_epu64_mask(low, n_buckets);
+            __m512i bucket = _mm512_mask_blend_epi64(leq, high, low);
+
+            _mm256_storeu_si256((__m256i *) (out + r * nstreams + g * 8),
+                                _mm512_cvtepi64_epi32(bucket));
+
+            x = lfsr_n_avx512(x, lfsr_iter);
+        }
+
+        _mm512_storeu_si512(states + g * 8, x);
+    }
+
+    bucket_streams_tail(m, out, rounds, states, groups * 8, nstreams);
+}
+#endif
+
+static bucket_streams_fn bucket_streams_impl;
+static pthread_once_t bucket_streams_once = PTHREAD_ONCE_INIT;
+
+static void bucket_streams_select(void)
+{
+    bucket_streams_impl = bucket_streams_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        bucket_streams_impl = bucket_streams_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        bucket_streams_impl = bucket_streams_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        bucket_streams_impl = bucket_streams_sse2;
+#endif
+}
+
+void bucket_streams(const struct bucket_mapper *m,
+                    unsigned int *out,
+                    unsigned int rounds,
+                    uint64_t *states,
+                    unsigned int nstreams)
+{
+    pthread_once(&bucket_streams_once, bucket_streams_select);
+    bucket_streams_impl(m, out, rounds, states, nstreams);
+}
+
+/* fill_buckets with @nstreams streams, each running @iterations times */
+void fill_buckets_multi(const struct bucket_mapper *m,
+                        unsigned int *buckets,
+                        unsigned int iterations,
+                        const uint64_t *seeds,
+                        unsigned int nstreams)
+{
+    enum { CHUNK = 256 };
+    uint64_t *states = malloc(nstreams * sizeof(uint64_t));
+    unsigned int *out = malloc(CHUNK * nstreams * sizeof(unsigned int));
+
+    memcpy(states, seeds, nstreams * sizeof(uint64_t));
+    for (unsigned int done = 0; done < iterations;) {
+        unsigned int rounds =
+            iterations - done < CHUNK ? iterations - done : CHUNK;
+
+        bucket_streams(m, out, rounds, states, nstreams);
+        for (unsigned int i = 0; i < rounds * nstreams; i++)
+            buckets[out[i]]++;
+        done += rounds;
+    }
+
+    free(out);
+    free(states);
+}
+
+/* Parallel fill_buckets
+ *
+ * The single LFSR sequence of fill_buckets is cut into @nthreads contiguous
+ * parts, and every thread jumps to the start of its part with lfsr_jump. The
+ * threads count into private histograms, padded to whole cache lines so no
+ * two threads write to the same line, which are summed up at the end. The
+ * result is exactly the one of fill_buckets. Parts which get no thread
+ * because pthread_create fails are done by the calling thread.
+ *
+ * Return: 0 on success, -1 when out of memory or, with errno set to EINVAL,
+ * when @nthreads is 0
+ */
+#define CACHE_LINE 64
+
+struct fill_part {
+    pthread_t thread;
+    const struct bucket_mapper *m;
+    uint64_t first, count;
+    unsigned int *hist;
+};
+
+static void *fill_buckets_part(void *arg)
+{
+    struct fill_part *part = arg;
+    const struct bucket_mapper *m = part->m;
+    unsigned char lfsr_iter = m->lfsr_iter;
+    unsigned int *hist = part->hist;
+    uint64_t x = lfsr_jump(LFSR_SEED, part->first * lfsr_iter);
+
+    for (uint64_t i = 0; i < part->count; i++) {
+        hist[bucket_number(m, x)]++;
+        lfsr_n(&x, lfsr_iter);
+    }
+
+    return NULL;
+}
+
+int fill_buckets_parallel(const struct bucket_mapper *m,
+                          unsigned int *buckets,
+                          uint64_t iterations,
+                          unsigned int nthreads)
+{
+    size_t stride = (m->n_buckets * sizeof(unsigned int) + CACHE_LINE - 1) &
+                    ~(size_t) (CACHE_LINE - 1);
+    struct fill_part *parts = calloc(nthreads, sizeof(*parts));
+    unsigned int *hists = aligned_alloc(CACHE_LINE, stride * nthreads);
+    uint64_t first = 0;
+    unsigned int t;
+
+    if (!nthreads) {
+        free(parts);
+        free(hists);
+        errno = EINVAL;
+        return -1;
+    }
+    if (!parts || !hists) {
+        free(parts);
+        free(hists);
+        return -1;
+    }
+    memset(hists, 0, stride * nthreads);
+
+    for (t = 0; t < nthreads; t++) {
+        parts[t].m = m;
+        parts[t].first = first;
+        parts[t].count = iterations / nthreads + (t < iterations % nthreads);
+        parts[t].hist = (unsigned int *) ((char *) hists + stride * t);
+        first += parts[t].count;
+    }
+
+    /* the calling thread takes the first part itself */
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&parts[t].thread, NULL, fill_buckets_part,
+                           &parts[t]))
+            break;
+    }
+    fill_buckets_part(&parts[0]);
+
+    /* parts which got no thread are done here */
+    for (unsigned int u = t; u < nthreads; u++)
+        fill_buckets_part(&parts[u]);
+
+    for (unsigned int u = 0; u < nthreads; u++) {
+        if (u && u < t)
+            pthread_join(parts[u].thread, NULL);
+        for (unsigned int i = 0; i < m->n_buckets; i++)
+            buckets[i] += parts[u].hist[i];
+    }
+
+    free(hists);
+    free(parts);
+    return 0;
+}
+
+/* Assignment of keys to shards
+ *
+ * Mapping a key with one of the mappers above moves almost every key to
+ * another bucket when the bucket count changes. Two consistent modes only
+ * move the keys which have to move, about 1 / (n_buckets + 1) of them when a
+ * bucket is added:
+ *
+ * - jump: jump consistent hash (Lamping, Veach, "A Fast, Minimal Memory,
+ *   Consistent Hash Algorithm"), O(log n_buckets) per key, no state. Buckets
+ *   can only be added or removed at the end.
+ * - rendezvous: highest random weight hashing (Thaler, Ravishankar), the key
+ *   goes to the bucket with the largest hash of (key, bucket). O(n_buckets)
+ *   per key, but any bucket can be removed.
+ *
+ * Keys are mixed first, so they need not be random themselves.
+ */
+enum bucket_assign {
+    BUCKET_ASSIGN_MAP, /* fastmod of the mixed key */
+    BUCKET_ASSIGN_JUMP,
+    BUCKET_ASSIGN_RENDEZVOUS,
+    BUCKET_ASSIGN_COUNT,
+};
+
+static const char *const bucket_assign_names[BUCKET_ASSIGN_COUNT] = {
+    [BUCKET_ASSIGN_MAP] = "map",
+    [BUCKET_ASSIGN_JUMP] = "jump",
+    [BUCKET_ASSIGN_RENDEZVOUS] = "rendezvous",
+};
+
+/* splitmix64 finalizer */
+static inline uint64_t mix64(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+}
+
+static inline unsigned int bucket_jump(uint64_t key, unsigned int n_buckets)
+{
+    int64_t b = -1, j = 0;
+
+    while (j < n_buckets) {
+        b = j;
+        key = key * UINT64_C(2862933555777941757) + 1;
+        j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+    }
+
+    return b;
+}
+
+static inline unsigned int bucket_rendezvous(uint64_t key,
+                                             unsigned int n_buckets)
+{
+    uint64_t best = 0;
+    unsigned int bucket = 0;
+
+    for (unsigned int b = 0; b < n_buckets; b++) {
+        uint64_t w = mix64(key ^ mix64(b + UINT64_C(0x9e3779b97f4a7c15)));
+
+        if (w > best) {
+            best = w;
+            bucket = b;
+        }
+    }
+
+    return bucket;
+}
+
+/* Assign @n keys to the buckets of @m, out[i] is the bucket of keys[i] */
+void bucket_assign_batch(const struct bucket_mapper *m,
+                         enum bucket_assign mode,
+                         const uint64_t *keys,
+                         unsigned int *out,
+                         size_t n)
 {
-    int i = 0;
-    while (i < N_BUCKETS) {
-        printf("%d:%d , ", i, *(buckets + i));
+    switch (mode) {
+    case BUCKET_ASSIGN_MAP:
+        for (size_t i = 0; i < n; i++) {
+            uint64_t h = mix64(keys[i]);
+
+            out[i] = bucket_number_fastmod(m, &h);
+        }
+        break;
+    case BUCKET_ASSIGN_JUMP:
+        for (size_t i = 0; i < n; i++)
+            out[i] = bucket_jump(mix64(keys[i]), m->n_buckets);
+        break;
+    case BUCKET_ASSIGN_RENDEZVOUS:
+        for (size_t i = 0; i < n; i++)
+            out[i] = bucket_rendezvous(mix64(keys[i]), m->n_buckets);
+        break;
+    default:
+        break;
+    }
+}
+
+void evaluate_buckets(const struct bucket_mapper *m, unsigned int *buckets)
+{
+    unsigned int i = 0;
+    while (i < m->n_buckets) {
+        printf("%u:%u , ", i, *(buckets + i));
         i++;
         if (i % 10 == 0)
             printf("\n");
     }
 }
 
-int main()
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, uint64_t samples, double elapsed)
+{
+    printf("%-24s %12llu samples %9.3f ms %9.2f Msamples/s\n", name,
+           (unsigned long long) samples, elapsed * 1e3,
+           samples / elapsed * 1e-6);
+}
+
+/* Check lfsr_n against lfsr and compare the speed of both fill_buckets */
+static int bench_lfsr(const struct bucket_mapper *m, unsigned int iterations)
+{
+    unsigned int *ref = calloc(m->n_buckets, sizeof(unsigned int));
+    unsigned int *fast = calloc(m->n_buckets, sizeof(unsigned int));
+    uint64_t a = LFSR_SEED, b = LFSR_SEED;
+    double t;
+    int ret = 0;
+
+    for (unsigned int n = 0; n < 1000; n++) {
+        for (unsigned int i = 0; i < n % 70; i++)
+            lfsr(&a);
+        lfsr_n(&b, n % 70);
+        if (a != b) {
+            printf("lfsr_n mismatch after step %u\n", n);
+            ret = 1;
+            break;
+        }
+    }
+
+    t = now();
+    fill_buckets_bitwise(m, ref, iterations);
+    report("fill_buckets bitwise", iterations, now() - t);
+
+    t = now();
+    fill_buckets(m, fast, iterations);
+    report("fill_buckets lfsr_n", iterations, now() - t);
+
+    if (memcmp(ref, fast, m->n_buckets * sizeof(unsigned int))) {
+        printf("fill_buckets mismatch\n");
+        ret = 1;
+    }
+
+    free(ref);
+    free(fast);
+    return ret;
+}
+
+/* Check every SIMD version lane by lane against the scalar one */
+static int bench_streams(const struct bucket_mapper *m, unsigned int rounds)
+{
+    const struct {
+        const char *name;
+        bucket_streams_fn fn;
+        bool supported;
+    } impls[] = {
+        {"bucket_streams scalar", bucket_streams_scalar, true},
+#ifdef HAVE_X86_SIMD
+        {"bucket_streams sse2", bucket_streams_sse2,
+         __builtin_cpu_supports("sse2")},
+        {"bucket_streams avx2", bucket_streams_avx2,
+         __builtin_cpu_supports("avx2")},
+        {"bucket_streams avx512", bucket_streams_avx512,
+         __builtin_cpu_supports("avx512f")},
+#endif
+    };
+    enum { NSTREAMS = 19 }; /* not a multiple of the lane count */
+    unsigned int *ref = malloc(rounds * NSTREAMS * sizeof(unsigned int));
+    unsigned int *out = malloc(rounds * NSTREAMS * sizeof(unsigned int));
+    uint64_t seeds[NSTREAMS], states[NSTREAMS];
+    int ret = 0;
+    double t;
+
+    for (unsigned int i = 0; i < NSTREAMS; i++)
+        seeds[i] = LFSR_SEED ^ (0x9e3779b97f4a7c15ULL * (i + 1));
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (!impls[i].supported)
+            continue;
+
+        memcpy(states, seeds, sizeof(seeds));
+        t = now();
+        impls[i].fn(m, i ? out : ref, rounds, states, NSTREAMS);
+        report(impls[i].name, (uint64_t) rounds * NSTREAMS, now() - t);
+
+        if (i && memcmp(ref, out, rounds * NSTREAMS * sizeof(unsigned int))) {
+            printf("%s differs from scalar\n", impls[i].name);
+            ret = 1;
+        }
+    }
+
+    free(ref);
+    free(out);
+    return ret;
+}
+
+DEFINE_FILL_BUCKETS_CONST(fill_buckets_120, 120)
+
+/* fill_buckets with the mapper read at run time against the one folded for a
+ * constant bucket count
+ */
+static int bench_mapper_const(const struct bucket_mapper *m,
+                              unsigned int iterations)
+{
+    unsigned int *ref = calloc(m->n_buckets, sizeof(unsigned int));
+    unsigned int *fast = calloc(m->n_buckets, sizeof(unsigned int));
+    int ret = 0;
+    double t;
+
+    if (m->n_buckets != 120)
+        goto out;
+
+    t = now();
+    fill_buckets(m, ref, iterations);
+    report("fill_buckets runtime", iterations, now() - t);
+
+    t = now();
+    fill_buckets_120(fast, iterations);
+    report("fill_buckets const 120", iterations, now() - t);
+
+    if (memcmp(ref, fast, m->n_buckets * sizeof(unsigned int))) {
+        printf("fill_buckets_120 differs from fill_buckets\n");
+        ret = 1;
+    }
+
+out:
+    free(ref);
+    free(fast);
+    return ret;
+}
+
+/* Thread scaling of fill_buckets_parallel from 2^24 up to 2^max_log2
+ * iterations. The smallest size is checked against fill_buckets.
+ */
+static int bench_parallel(const struct bucket_mapper *m, unsigned int max_log2)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int *ref = calloc(m->n_buckets, sizeof(unsigned int));
+    unsigned int *buckets = malloc(m->n_buckets * sizeof(unsigned int));
+    char name[64];
+    int ret = 0;
+    double t;
+
+    fill_buckets(m, ref, 1u << 24);
+
+    for (unsigned int log2 = 24; log2 <= max_log2; log2 += 4) {
+        for (long n = 1; n <= ncpu; n *= 2) {
+            /* always finish with all cores */
+            if (n * 2 > ncpu)
+                n = ncpu;
+
+            memset(buckets, 0, m->n_buckets * sizeof(unsigned int));
+            snprintf(name, sizeof(name), "parallel 2^%u %ld threads", log2, n);
+            t = now();
+            fill_buckets_parallel(m, buckets, 1ULL << log2, n);
+            report(name, 1ULL << log2, now() - t);
+
+            if (log2 == 24 &&
+                memcmp(ref, buckets, m->n_buckets * sizeof(unsigned int))) {
+                printf("%s differs from fill_buckets\n", name);
+                ret = 1;
+            }
+        }
+    }
+
+    free(ref);
+    free(buckets);
+    return ret;
+}
+
+/* Pearson's chi-square statistic of the histogram against uniform */
+static double chi_square(const struct bucket_mapper *m,
+                         const unsigned int *buckets,
+                         uint64_t samples)
+{
+    double expected = (double) samples / m->n_buckets, chi2 = 0;
+
+    for (unsigned int i = 0; i < m->n_buckets; i++) {
+        double d = buckets[i] - expected;
+        chi2 += d * d / expected;
+    }
+
+    return chi2;
+}
+
+/* Throughput and uniformity of every mapper. For a uniform source the
+ * statistic is close to n_buckets - 1, z is its distance in standard
+ * deviations.
+ */
+static void bench_mappers(unsigned int iterations)
+{
+    static const unsigned int counts[] = {120, 1000, 1024, 100000};
+    struct bucket_mapper m;
+    char name[64];
+    double t;
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        unsigned int *buckets = malloc(counts[c] * sizeof(unsigned int));
+
+        bucket_mapper_init(&m, counts[c]);
+        for (int map = 0; map < BUCKET_MAP_COUNT; map++) {
+            double chi2, dof = m.n_buckets - 1;
+
+            memset(buckets, 0, m.n_buckets * sizeof(unsigned int));
+            snprintf(name, sizeof(name), "map %s n=%u",
+                     bucket_mappers[map].name, m.n_buckets);
+            t = now();
+            fill_buckets_map(&m, buckets, iterations, map);
+            report(name, iterations, now() - t);
+
+            chi2 = chi_square(&m, buckets, iterations);
+            printf("%-24s chi2 %.1f dof %.0f z %.2f\n", "", chi2, dof,
+                   (chi2 - dof) / sqrt(2 * dof));
+        }
+        free(buckets);
+    }
+}
+
+/* Throughput of every assignment mode and the fraction of keys which change
+ * their bucket when the bucket count grows by one. The consistent modes should
+ * move 1 / (n + 1) of the keys, "ideal". chi2 checks the bucket sizes against
+ * uniform.
+ */
+static int bench_assign(unsigned int nkeys)
+{
+    static const unsigned int counts[] = {10, 120, 1000};
+    uint64_t *keys = malloc(nkeys * sizeof(uint64_t));
+    unsigned int *before = malloc(nkeys * sizeof(unsigned int));
+    unsigned int *after = malloc(nkeys * sizeof(unsigned int));
+    struct bucket_mapper m, grown;
+    char name[64];
+    int ret = 0;
+    double t;
+
+    /* sequential ids, the worst case for an unmixed mapping */
+    for (unsigned int i = 0; i < nkeys; i++)
+        keys[i] = i;
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        bucket_mapper_init(&m, counts[c]);
+        bucket_mapper_init(&grown, counts[c] + 1);
+
+        for (int mode = 0; mode < BUCKET_ASSIGN_COUNT; mode++) {
+            unsigned int *hist = calloc(m.n_buckets, sizeof(unsigned int));
+            unsigned int moved = 0, bad = 0;
+
+            snprintf(name, sizeof(name), "assign %s n=%u",
+                     bucket_assign_names[mode], m.n_buckets);
+            t = now();
+            bucket_assign_batch(&m, mode, keys, before, nkeys);
+            report(name, nkeys, now() - t);
+            bucket_assign_batch(&grown, mode, keys, after, nkeys);
+
+            for (unsigned int i = 0; i < nkeys; i++) {
+                hist[before[i]]++;
+                if (before[i] != after[i]) {
+                    moved++;
+                    /* a consistent mode may only move keys to the new one */
+                    bad += after[i] != m.n_buckets;
+                }
+            }
+            printf("%-24s moved %.4f ideal %.4f chi2 %.1f dof %u\n", "",
+                   (double) moved / nkeys, 1.0 / grown.n_buckets,
+                   chi_square(&m, hist, nkeys), m.n_buckets - 1);
+
+            if (mode != BUCKET_ASSIGN_MAP && bad) {
+                printf("%s moved %u keys between old buckets\n", name, bad);
+                ret = 1;
+            }
+            free(hist);
+        }
+    }
+
+    free(keys);
+    free(before);
+    free(after);
+    return ret;
+}
+
+/* Upper regularized incomplete gamma function Q(a, x), from the series for
+ * small x and the continued fraction otherwise (Numerical Recipes 6.2)
+ */
+static double gamma_q(double a, double x)
+{
+    double gln = lgamma(a);
+
+    if (x <= 0)
+        return 1;
+
+    if (x < a + 1) {
+        double sum = 1 / a, del = sum;
+
+        for (double ap = a; fabs(del) > fabs(sum) * 1e-15;) {
+            ap += 1;
+            del *= x / ap;
+            sum += del;
+        }
+        return 1 - sum * exp(-x + a * log(x) - gln);
+    }
+
+    double b = x + 1 - a, c = 1 / 1e-300, d = 1 / b, h = d;
+
+    for (int i = 1; i < 100000; i++) {
+        double an = -i * (i - a), del;
+
+        b += 2;
+        d = an * d + b;
+        if (fabs(d) < 1e-300)
+            d = 1e-300;
+        c = b + an / c;
+        if (fabs(c) < 1e-300)
+            c = 1e-300;
+        d = 1 / d;
+        del = d * c;
+        h *= del;
+        if (fabs(del - 1) < 1e-15)
+            break;
+    }
+    return exp(-x + a * log(x) - gln) * h;
+}
+
+/* Probability that a uniform source gives a chi-square at least this large */
+static double chi_square_pvalue(double chi2, double dof)
+{
+    return gamma_q(dof / 2, chi2 / 2);
+}
+
+/* Quality and speed of every mapper over many bucket counts, as CSV
+ *
+ * max_dev and min_dev are the relative deviation of the fullest and the
+ * emptiest bucket from the expected count. serial_corr is the correlation of
+ * consecutive bucket numbers, close to 0 for an independent sequence.
+ */
+static void quality_report(unsigned int iterations)
+{
+    static const unsigned int counts[] = {
+        2,   3,   5,    7,    8,    10,    16,    17,    100,   120,
+        128, 255, 256, 1000, 1024, 4096, 10007, 65536, 100000,
+    };
+    struct bucket_mapper m;
+
+    printf("n_buckets,mapper,samples,samples_per_sec,chi2,dof,p_value,"
+           "max_dev,min_dev,serial_corr\n");
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        unsigned int *buckets = malloc(counts[c] * sizeof(unsigned int));
+
+        bucket_mapper_init(&m, counts[c]);
+        for (int map = 0; map < BUCKET_MAP_COUNT; map++) {
+            bucket_map_fn fn = bucket_mappers[map].fn;
+            unsigned int lfsr_iter = bucket_map_steps(&m, map);
+            double expected = (double) iterations / m.n_buckets;
+            double sum = 0, sum_sq = 0, sum_lag = 0, elapsed, chi2, corr;
+            unsigned int prev = 0, max = 0, min = UINT32_MAX;
+            uint64_t x = LFSR_SEED;
+
+            /* timed run without the statistics */
+            memset(buckets, 0, m.n_buckets * sizeof(unsigned int));
+            elapsed = now();
+            fill_buckets_map(&m, buckets, iterations, map);
+            elapsed = now() - elapsed;
+
+            for (unsigned int i = 0; i < iterations; i++) {
+                unsigned int b = fn(&m, &x);
+
+                sum += b;
+                sum_sq += (double) b * b;
+                if (i)
+                    sum_lag += (double) prev * b;
+                prev = b;
+                lfsr_n(&x, lfsr_iter);
+            }
+
+            for (unsigned int i = 0; i < m.n_buckets; i++) {
+                max = buckets[i] > max ? buckets[i] : max;
+                min = buckets[i] < min ? buckets[i] : min;
+            }
+
+            double mean = sum / iterations;
+            double var = sum_sq / iterations - mean * mean;
+            corr = var > 0 ? (sum_lag / (iterations - 1) - mean * mean) / var
+                           : 0;
+            chi2 = chi_square(&m, buckets, iterations);
+
+            printf("%u,%s,%u,%.0f,%.2f,%u,%.6g,%.6f,%.6f,%.6f\n", m.n_buckets,
+                   bucket_mappers[map].name, iterations, iterations / elapsed,
+                   chi2, m.n_buckets - 1,
+                   chi_square_pvalue(chi2, m.n_buckets - 1),
+                   (max - expected) / expected, (min - expected) / expected,
+                   corr);
+        }
+        free(buckets);
+    }
+}
+
+int main(int argc, char *argv[])
 {
     int num_of_buckets = 120;          /* an example of some non-power of 2 */
     int num_of_iterations = (1 << 20); /* roughly 1 million */
 
-    set_N_BUCKETS(num_of_buckets);
-    set_N_BITS();
+    struct bucket_mapper m;
+
+    bucket_mapper_init(&m, num_of_buckets);
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench_lfsr(&m, 1 << 24) | bench_streams(&m, 1 << 20) |
+               bench_mapper_const(&m, 1 << 24);
+    if (argc > 1 && !strcmp(argv[1], "mappers")) {
+        bench_mappers(1 << 24);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "quality")) {
+        quality_report(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 22);
+        return 0;
+    }
+    if (argc > 1 && !strcmp(argv[1], "assign"))
+        return bench_assign(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 18);
+    if (argc > 1 && !strcmp(argv[1], "parallel"))
+        return bench_parallel(&m, argc > 2 ? atoi(argv[2]) : 32);
 
-    unsigned int *buckets = malloc(N_BUCKETS * sizeof(unsigned int));
+    unsigned int *buckets = malloc(m.n_buckets * sizeof(unsigned int));
 
-    int i = 0;
-    while (i < N_BUCKETS) {
+    unsigned int i = 0;
+    while (i < m.n_buckets) {
         *(buckets + i) = 0;
         i++;
     }
-    fill_buckets(buckets, num_of_iterations);
-    evaluate_buckets(buckets);
+    fill_buckets(&m, buckets, num_of_iterations);
+    evaluate_buckets(&m, buckets);
     free(buckets);
     return 0;
 }
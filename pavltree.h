@@ -0,0 +1,502 @@
+#pragma once
+
+/*
+ * Persistent avl tree with path copying
+ *
+ * A struct pavl_tree is changed by a single writer. pavl_snapshot takes a
+ * read-only view of its current version in O(1) by taking a reference on the
+ * root. An update never changes a node which is shared with a snapshot, it
+ * copies the path from the root down to the change instead. The copies share
+ * all other subtrees with the old version, so an update allocates O(log n)
+ * nodes while snapshots exist. Nodes which only the writer's version uses are
+ * changed in place, so without snapshots an update allocates no more than the
+ * inserted node. It is still about 3 times slower to build than avltree.h and
+ * up to 2 times slower under erase+insert churn, because of the recursive
+ * updates and the reference counts. With snapshots, builds are 16 to 28 times
+ * slower and churn 3 to 8 times.
+ *
+ * Every node counts the parent nodes and versions which reference it. Once a
+ * node is shared, every path through it is shared as well, so a count of one
+ * on all nodes of a path means the writer owns it. The counts are atomic, a
+ * snapshot may be read and released in another thread. Releasing the last
+ * reference to a version frees the nodes which no other version uses.
+ *
+ * Unlike avltree.h the nodes are not embedded in the entries and have no
+ * parent pointers, which would tie a node to a single version. Keys are
+ * int64_t and unique, values are opaque pointers.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* avl trees are never higher than 1.44 * log2(n) */
+#define PAVL_MAX_HEIGHT 96
+
+/**
+ * struct pavl_node - node of a persistent avl tree
+ * @left: subtree with the smaller keys
+ * @right: subtree with the larger keys
+ * @key: key of the node
+ * @value: value stored for @key
+ * @refs: number of parent nodes and versions which reference the node
+ * @height: number of levels of the subtree rooted at the node
+ *
+ * Nodes which are reachable from a snapshot never change.
+ */
+struct pavl_node {
+    struct pavl_node *left, *right;
+    int64_t key;
+    void *value;
+    unsigned int refs;
+    int height;
+};
+
+/**
+ * struct pavl_tree - version of a persistent avl tree owned by the writer
+ * @root: root node, NULL for an empty tree
+ * @size: number of keys
+ * @allocated: number of nodes allocated so far, for statistics
+ * @spare: list of free nodes linked through @right
+ * @nspare: number of nodes in @spare
+ *
+ * The free nodes cover the worst case of the next update, so an update
+ * which has started never runs out of memory.
+ */
+struct pavl_tree {
+    struct pavl_node *root;
+    size_t size;
+    unsigned long allocated;
+    struct pavl_node *spare;
+    unsigned int nspare;
+};
+
+/**
+ * struct pavl_snapshot - read-only version of a persistent avl tree
+ * @root: root node, NULL for an empty tree
+ * @size: number of keys
+ */
+struct pavl_snapshot {
+    struct pavl_node *root;
+    size_t size;
+};
+
+/**
+ * struct pavl_iter - in-order iterator
+ * @stack: nodes whose key and right subtree are still to be visited
+ * @depth: number of nodes on @stack
+ */
+struct pavl_iter {
+    const struct pavl_node *stack[PAVL_MAX_HEIGHT];
+    unsigned int depth;
+};
+
+static inline int pavl_height(const struct pavl_node *node)
+{
+    return node ? node->height : 0;
+}
+
+static inline void pavl_get(struct pavl_node *node)
+{
+    if (node)
+        __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference, freeing the node and the nodes only it referenced */
+static inline void pavl_put(struct pavl_node *node)
+{
+    while (node && !__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL)) {
+        struct pavl_node *right = node->right;
+
+        pavl_put(node->left);
+        free(node);
+        node = right;
+    }
+}
+
+/**
+ * pavl_init() - Initialize an empty tree
+ * @tree: tree to initialize
+ */
+static inline void pavl_init(struct pavl_tree *tree)
+{
+    *tree = (struct pavl_tree){NULL, 0, 0, NULL, 0};
+}
+
+/**
+ * pavl_destroy() - Release the writer's version and the free nodes
+ * @tree: tree to destroy, it is empty afterwards
+ *
+ * Nodes which snapshots still use are freed when the snapshots are released.
+ */
+static inline void pavl_destroy(struct pavl_tree *tree)
+{
+    pavl_put(tree->root);
+    while (tree->spare) {
+        struct pavl_node *node = tree->spare;
+
+        tree->spare = node->right;
+        free(node);
+    }
+    pavl_init(tree);
+}
+
+/**
+ * pavl_snapshot() - Take a read-only view of the current version in O(1)
+ * @tree: tree to take the snapshot of
+ * @snap: the snapshot, release it with pavl_snapshot_release
+ */
+static inline void pavl_snapshot(struct pavl_tree *tree,
+                                 struct pavl_snapshot *snap)
+{
+    pavl_get(tree->root);
+    snap->root = tree->root;
+    snap->size = tree->size;
+}
+
+/**
+ * pavl_snapshot_release() - Drop a snapshot
+ * @snap: snapshot from pavl_snapshot, may be released in any thread
+ */
+static inline void pavl_snapshot_release(struct pavl_snapshot *snap)
+{
+    pavl_put(snap->root);
+    snap->root = NULL;
+    snap->size = 0;
+}
+
+/* Fill the free list up to @n nodes */
+static inline int pavl_reserve(struct pavl_tree *tree, unsigned int n)
+{
+    while (tree->nspare < n) {
+        struct pavl_node *node = malloc(sizeof(*node));
+
+        if (!node) {
+            errno = ENOMEM;
+            return -1;
+        }
+        node->right = tree->spare;
+        tree->spare = node;
+        tree->nspare++;
+        tree->allocated++;
+    }
+    return 0;
+}
+
+static inline struct pavl_node *pavl_take(struct pavl_tree *tree)
+{
+    struct pavl_node *node = tree->spare;
+
+    tree->spare = node->right;
+    tree->nspare--;
+    return node;
+}
+
+/* Put a node which only the writer used back on the free list */
+static inline void pavl_recycle(struct pavl_tree *tree, struct pavl_node *node)
+{
+    node->right = tree->spare;
+    tree->spare = node;
+    tree->nspare++;
+}
+
+/* Take over the reference the caller holds on @node and return a node with
+ * the same content which the writer may change: @node itself when nobody else
+ * references it, otherwise a copy. The acquire load orders the changes after
+ * the reads of a reader which has just released its snapshot.
+ */
+static inline struct pavl_node *pavl_own(struct pavl_tree *tree,
+                                         struct pavl_node *node)
+{
+    struct pavl_node *copy;
+
+    if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+        return node;
+
+    copy = pavl_take(tree);
+    *copy = *node;
+    copy->refs = 1;
+    pavl_get(copy->left);
+    pavl_get(copy->right);
+    pavl_put(node);
+    return copy;
+}
+
+static inline void pavl_update_height(struct pavl_node *node)
+{
+    int l = pavl_height(node->left), r = pavl_height(node->right);
+
+    node->height = (l > r ? l : r) + 1;
+}
+
+/* @node and its left child are owned by the writer */
+static inline struct pavl_node *pavl_rotate_right(struct pavl_node *node)
+{
+    struct pavl_node *left = node->left;
+
+    node->left = left->right;
+    pavl_update_height(node);
+    left->right = node;
+    pavl_update_height(left);
+    return left;
+}
+
+/* @node and its right child are owned by the writer */
+static inline struct pavl_node *pavl_rotate_left(struct pavl_node *node)
+{
+    struct pavl_node *right = node->right;
+
+    node->right = right->left;
+    pavl_update_height(node);
+    right->left = node;
+    pavl_update_height(right);
+    return right;
+}
+
+/* Restore the avl property of an owned node whose subtrees differ by at most
+ * two levels. The children taking part in a rotation are owned first, they
+ * may be shared when they are not on the updated path.
+ */
+static inline struct pavl_node *pavl_balance(struct pavl_tree *tree,
+                                             struct pavl_node *node)
+{
+    int diff = pavl_height(node->left) - pavl_height(node->right);
+
+    if (diff > 1) {
+        node->left = pavl_own(tree, node->left);
+        if (pavl_height(node->left->left) < pavl_height(node->left->right)) {
+            node->left->right = pavl_own(tree, node->left->right);
+            node->left = pavl_rotate_left(node->left);
+        }
+        return pavl_rotate_right(node);
+    }
+    if (diff < -1) {
+        node->right = pavl_own(tree, node->right);
+        if (pavl_height(node->right->right) < pavl_height(node->right->left)) {
+            node->right->left = pavl_own(tree, node->right->left);
+            node->right = pavl_rotate_right(node->right);
+        }
+        return pavl_rotate_left(node);
+    }
+    pavl_update_height(node);
+    return node;
+}
+
+static struct pavl_node *pavl_insert_node(struct pavl_tree *tree,
+                                          struct pavl_node *node,
+                                          int64_t key,
+                                          void *value)
+{
+    if (!node) {
+        node = pavl_take(tree);
+        *node = (struct pavl_node){NULL, NULL, key, value, 1, 1};
+        tree->size++;
+        return node;
+    }
+
+    node = pavl_own(tree, node);
+    if (key < node->key) {
+        node->left = pavl_insert_node(tree, node->left, key, value);
+    } else if (key > node->key) {
+        node->right = pavl_insert_node(tree, node->right, key, value);
+    } else {
+        node->value = value;
+        return node;
+    }
+    return pavl_balance(tree, node);
+}
+
+/**
+ * pavl_insert() - Insert a key or replace its value
+ * @tree: tree to update
+ * @key: key to insert
+ * @value: value stored for @key
+ *
+ * Snapshots taken before keep seeing the old version.
+ *
+ * Return: 0 on success, -1 with errno ENOMEM when the nodes for the update
+ *  cannot be allocated. The tree is unchanged on error.
+ */
+static inline int pavl_insert(struct pavl_tree *tree, int64_t key, void *value)
+{
+    /* a copy of every node on the path and the new leaf */
+    if (pavl_reserve(tree, pavl_height(tree->root) + 1))
+        return -1;
+    tree->root = pavl_insert_node(tree, tree->root, key, value);
+    return 0;
+}
+
+/* Unlink the smallest node of a subtree and return its key and value */
+static struct pavl_node *pavl_erase_min(struct pavl_tree *tree,
+                                        struct pavl_node *node,
+                                        int64_t *key,
+                                        void **value)
+{
+    node = pavl_own(tree, node);
+    if (!node->left) {
+        struct pavl_node *right = node->right;
+
+        *key = node->key;
+        *value = node->value;
+        pavl_recycle(tree, node);
+        return right;
+    }
+    node->left = pavl_erase_min(tree, node->left, key, value);
+    return pavl_balance(tree, node);
+}
+
+/* A path which does not end at @key is owned in vain but stays valid */
+static struct pavl_node *pavl_erase_node(struct pavl_tree *tree,
+                                         struct pavl_node *node,
+                                         int64_t key,
+                                         bool *found)
+{
+    if (!node)
+        return NULL;
+
+    node = pavl_own(tree, node);
+    if (key < node->key) {
+        node->left = pavl_erase_node(tree, node->left, key, found);
+    } else if (key > node->key) {
+        node->right = pavl_erase_node(tree, node->right, key, found);
+    } else if (!node->left || !node->right) {
+        struct pavl_node *child = node->left ? node->left : node->right;
+
+        *found = true;
+        pavl_recycle(tree, node);
+        return child;
+    } else {
+        *found = true;
+        node->right =
+            pavl_erase_min(tree, node->right, &node->key, &node->value);
+    }
+    return pavl_balance(tree, node);
+}
+
+/**
+ * pavl_find() - Look up a key in the writer's version or a snapshot
+ * @root: tree->root or snap->root
+ * @key: key to look for
+ *
+ * Return: node of @key, NULL when it is not in the tree
+ */
+static inline const struct pavl_node *pavl_find(const struct pavl_node *root,
+                                                int64_t key)
+{
+    while (root && root->key != key)
+        root = key < root->key ? root->left : root->right;
+    return root;
+}
+
+/**
+ * pavl_erase() - Remove a key
+ * @tree: tree to update
+ * @key: key to remove
+ *
+ * Snapshots taken before keep seeing the old version.
+ *
+ * Return: 0 on success, -1 with errno ENOENT when @key is not in the tree or
+ *  ENOMEM when the nodes for the update cannot be allocated. The content of
+ *  the tree is unchanged on error.
+ */
+static inline int pavl_erase(struct pavl_tree *tree, int64_t key)
+{
+    bool found = false;
+
+    /* a copy of every node on the path and of two nodes per level for the
+     * rotations
+     */
+    if (pavl_reserve(tree, 3 * pavl_height(tree->root)))
+        return -1;
+    tree->root = pavl_erase_node(tree, tree->root, key, &found);
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    tree->size--;
+    return 0;
+}
+
+static inline const struct pavl_node *pavl_iter_push(struct pavl_iter *it,
+                                                     const struct pavl_node *n)
+{
+    for (; n; n = n->left)
+        it->stack[it->depth++] = n;
+    return it->depth ? it->stack[it->depth - 1] : NULL;
+}
+
+/**
+ * pavl_iter_first() - Start an in-order walk
+ * @it: iterator
+ * @root: tree->root or snap->root
+ *
+ * Return: node with the smallest key, NULL for an empty tree
+ */
+static inline const struct pavl_node *pavl_iter_first(
+    struct pavl_iter *it,
+    const struct pavl_node *root)
+{
+    it->depth = 0;
+    return pavl_iter_push(it, root);
+}
+
+/**
+ * pavl_iter_next() - Advance an in-order walk
+ * @it: iterator on a node
+ *
+ * Return: node with the next larger key, NULL at the end
+ */
+static inline const struct pavl_node *pavl_iter_next(struct pavl_iter *it)
+{
+    const struct pavl_node *node = it->stack[--it->depth];
+
+    return pavl_iter_push(it, node->right);
+}
+
+/**
+ * pavl_for_each() - Iterate over all nodes of a version in ascending order
+ * @pos: const struct pavl_node * to use as loop cursor
+ * @it: struct pavl_iter for the walk
+ * @root: tree->root or snap->root
+ */
+#define pavl_for_each(pos, it, root) \
+    for (pos = pavl_iter_first(&(it), root); pos; pos = pavl_iter_next(&(it)))
+
+static inline int pavl_verify_node(const struct pavl_node *node,
+                                   const int64_t *lo,
+                                   const int64_t *hi,
+                                   size_t *count)
+{
+    int l, r;
+
+    if (!node)
+        return 0;
+    if (!__atomic_load_n(&node->refs, __ATOMIC_RELAXED) ||
+        (lo && node->key <= *lo) || (hi && node->key >= *hi))
+        return -1;
+
+    l = pavl_verify_node(node->left, lo, &node->key, count);
+    r = pavl_verify_node(node->right, &node->key, hi, count);
+    if (l < 0 || r < 0 || l - r > 1 || r - l > 1 ||
+        node->height != (l > r ? l : r) + 1)
+        return -1;
+
+    (*count)++;
+    return node->height;
+}
+
+/**
+ * pavl_verify() - Check order, heights and balance of a version
+ * @root: tree->root or snap->root
+ * @size: expected number of keys
+ *
+ * Return: true when @root is a valid avl tree with @size keys
+ */
+static inline bool pavl_verify(const struct pavl_node *root, size_t size)
+{
+    size_t count = 0;
+
+    return pavl_verify_node(root, NULL, NULL, &count) >= 0 && count == size;
+}
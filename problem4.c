@@ -1,27 +1,366 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-int ceil_log2(uint32_t x)
+#include "bitmath.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+_Static_assert(CEIL_LOG2_CONST(0) == 0 && CEIL_LOG2_CONST(1) == 0 &&
+                   CEIL_LOG2_CONST(1000) == 10 &&
+                   CEIL_LOG2_CONST(1ULL << 40) == 40 &&
+                   FLOOR_LOG2_CONST(UINT64_MAX) == 63,
+               "constant log2");
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t xorshift64(uint64_t *s)
+{
+    uint64_t x = *s;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+/* ceil_log2_32 of every element of @in, out[i] for in[i]
+ *
+ * The AVX2 version reads the exponent of the value converted to float. Only
+ * the highest bit of x - 1 matters, so the bit below it is cleared first and
+ * the conversion can never round up to the next power of two. Lanes with the
+ * sign bit set are x > 2^31 or x == 0 and are patched afterwards. The AVX-512
+ * version uses vplzcntd. Both give exactly the results of ceil_log2_32.
+ */
+typedef void (*ceil_log2_batch_fn)(const uint32_t *in, uint8_t *out, size_t n);
+
+static void ceil_log2_batch_scalar(const uint32_t *in, uint8_t *out, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        out[i] = ceil_log2_32(in[i]);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2"))) static inline __m256i ceil_log2_avx2(
+    __m256i x)
+{
+    const __m256i one = _mm256_set1_epi32(1);
+    __m256i y = _mm256_sub_epi32(x, one);
+    __m256i top = _mm256_andnot_si256(_mm256_srli_epi32(y, 1), y);
+    __m256i e = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(top)),
+                                  23);
+    __m256i r;
+
+    /* exponent - 127 + 1, y == 0 gives a negative value */
+    r = _mm256_sub_epi32(_mm256_and_si256(e, _mm256_set1_epi32(0xFF)),
+                         _mm256_set1_epi32(126));
+    r = _mm256_max_epi32(r, _mm256_setzero_si256());
+    r = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(r),
+                                             _mm256_castsi256_ps(
+                                                 _mm256_set1_epi32(32)),
+                                             _mm256_castsi256_ps(y)));
+    return _mm256_andnot_si256(
+        _mm256_cmpeq_epi32(x, _mm256_setzero_si256()), r);
+}
+
+__attribute__((target("avx2"))) static void ceil_log2_batch_avx2(
+    const uint32_t *in,
+    uint8_t *out,
+    size_t n)
+{
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = ceil_log2_avx2(_mm256_loadu_si256((void *) (in + i)));
+        __m256i b = ceil_log2_avx2(_mm256_loadu_si256((void *) (in + i + 8)));
+        __m256i c = ceil_log2_avx2(_mm256_loadu_si256((void *) (in + i + 16)));
+        __m256i d = ceil_log2_avx2(_mm256_loadu_si256((void *) (in + i + 24)));
+        __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(a, b),
+                                            _mm256_packus_epi32(c, d));
+
+        _mm256_storeu_si256((void *) (out + i),
+                            _mm256_permutevar8x32_epi32(bytes, order));
+    }
+
+    ceil_log2_batch_scalar(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512cd"))) static void ceil_log2_batch_avx512(
+    const uint32_t *in,
+    uint8_t *out,
+    size_t n)
+{
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i bits = _mm512_set1_epi32(32);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512i x = _mm512_loadu_si512(in + i);
+        __mmask16 nonzero = _mm512_test_epi32_mask(x, x);
+        __m512i r = _mm512_maskz_sub_epi32(
+            nonzero, bits, _mm512_lzcnt_epi32(_mm512_sub_epi32(x, one)));
+
+        _mm_storeu_si128((void *) (out + i), _mm512_cvtepi32_epi8(r));
+    }
+
+    ceil_log2_batch_scalar(in + i, out + i, n - i);
+}
+#endif
+
+static ceil_log2_batch_fn ceil_log2_batch_select(void)
 {
-    uint32_t r, shift;
-    int zero = (x == 0);
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd"))
+        return ceil_log2_batch_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return ceil_log2_batch_avx2;
+#endif
+    return ceil_log2_batch_scalar;
+}
 
-    x--;
-    r = (x > 0xFFFF) << 4;
-    x >>= r;
-    shift = (x > 0xFF) << 3;
-    x >>= shift;
-    r |= shift;
-    shift = (x > 0xF) << 2;
-    x >>= shift;
-    r |= shift;
-    shift = (x > 0x3) << 1;
-    x >>= shift;
-    return ((r | shift | x >> 1) + 1) * !zero;
+void ceil_log2_batch(const uint32_t *in, uint8_t *out, size_t n)
+{
+    static ceil_log2_batch_fn impl;
+
+    if (!impl)
+        impl = ceil_log2_batch_select();
+    impl(in, out, n);
+}
+
+/* Array versions of the single value functions, for the benchmark */
+#define DEFINE_LOG2_LOOP(name, type, fn)                            \
+    static void name(const type *in, uint8_t *out, size_t n)        \
+    {                                                               \
+        for (size_t i = 0; i < n; i++)                              \
+            out[i] = fn(in[i]);                                     \
+    }
+
+DEFINE_LOG2_LOOP(ceil_log2_32_shift_loop, uint32_t, ceil_log2_32_shift)
+DEFINE_LOG2_LOOP(ceil_log2_32_loop, uint32_t, ceil_log2_32)
+DEFINE_LOG2_LOOP(floor_log2_64_table_loop, uint64_t, floor_log2_64_table)
+DEFINE_LOG2_LOOP(floor_log2_64_loop, uint64_t, floor_log2_64)
+DEFINE_LOG2_LOOP(ceil_log2_64_loop, uint64_t, ceil_log2_64)
+
+/* Random values with a uniformly distributed bit length */
+static void fill_values(uint64_t *v, size_t n, int bits)
+{
+    uint64_t s = 0x9e3779b97f4a7c15ULL;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t r = xorshift64(&s);
+        uint64_t x = bits == 32 ? (uint32_t) r : r;
+
+        v[i] = (x >> ((r >> 58) % bits)) | 1;
+    }
+}
+
+/* Compare every variant against each other, then time them */
+static int bench_log2(size_t n, int reps)
+{
+    uint32_t *v32 = malloc(n * sizeof(uint32_t));
+    uint64_t *v64 = malloc(n * sizeof(uint64_t));
+    uint8_t *ref = malloc(n), *out = malloc(n);
+    const struct {
+        const char *name;
+        void (*fn32)(const uint32_t *, uint8_t *, size_t);
+        void (*fn64)(const uint64_t *, uint8_t *, size_t);
+    } impls[] = {
+        {"ceil_log2_32 shift", ceil_log2_32_shift_loop, NULL},
+        {"ceil_log2_32 clz", ceil_log2_32_loop, NULL},
+        {"ceil_log2_32_batch", ceil_log2_32_batch, NULL},
+        {"floor_log2_64 table", NULL, floor_log2_64_table_loop},
+        {"floor_log2_64 clz", NULL, floor_log2_64_loop},
+        {"floor_log2_64_batch", NULL, floor_log2_64_batch},
+        {"ceil_log2_64 clz", NULL, ceil_log2_64_loop},
+        {"ceil_log2_64_batch", NULL, ceil_log2_64_batch},
+    };
+    uint64_t *tmp = malloc(n * sizeof(uint64_t));
+    int ret = 0;
+
+    fill_values(tmp, n, 32);
+    for (size_t i = 0; i < n; i++)
+        v32[i] = tmp[i];
+    fill_values(v64, n, 64);
+    free(tmp);
+
+    /* powers of two and their neighbours */
+    for (size_t b = 0; b < 32 && 3 * b + 2 < n; b++) {
+        v32[3 * b] = (1u << b) - 1;
+        v32[3 * b + 1] = 1u << b;
+        v32[3 * b + 2] = (1u << b) + 1;
+    }
+    for (size_t b = 0; b < 64 && 3 * b + 2 < n; b++) {
+        v64[3 * b] = (1ULL << b) - 1 + (b == 0);
+        v64[3 * b + 1] = 1ULL << b;
+        v64[3 * b + 2] = (1ULL << b) + 1;
+    }
+
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        double t;
+
+        t = now();
+        for (int r = 0; r < reps; r++) {
+            if (impls[i].fn32)
+                impls[i].fn32(v32, out, n);
+            else
+                impls[i].fn64(v64, out, n);
+        }
+        t = now() - t;
+        printf("%-24s %12zu values %9.3f ms %9.2f Mvalues/s\n", impls[i].name,
+               n * reps, t * 1e3, n * reps / t * 1e-6);
+
+        /* the first one of each kind is the reference */
+        if (i == 0 || i == 3 || i == 6) {
+            memcpy(ref, out, n);
+            if (i == 6) {
+                /* check ceil_log2_64 against the table version */
+                for (size_t j = 0; j < n; j++) {
+                    uint64_t x = v64[j];
+                    int c = x > 1 ? floor_log2_64_table(x - 1) + 1 : 0;
+
+                    if (ref[j] != c) {
+                        printf("ceil_log2_64(%llu) = %d, expected %d\n",
+                               (unsigned long long) x, ref[j], c);
+                        ret = 1;
+                        break;
+                    }
+                }
+            }
+        } else if (memcmp(ref, out, n)) {
+            printf("%s differs\n", impls[i].name);
+            ret = 1;
+        }
+    }
+
+    free(v32);
+    free(v64);
+    free(ref);
+    free(out);
+    return ret;
+}
+
+/* Every ceil_log2_batch version the CPU can run, the scalar one first */
+static size_t ceil_log2_batch_impls(const char **names, ceil_log2_batch_fn *fns)
+{
+    size_t n = 0;
+
+    names[n] = "ceil_log2_batch scalar";
+    fns[n++] = ceil_log2_batch_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        names[n] = "ceil_log2_batch avx2";
+        fns[n++] = ceil_log2_batch_avx2;
+    }
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512cd")) {
+        names[n] = "ceil_log2_batch avx512";
+        fns[n++] = ceil_log2_batch_avx512;
+    }
+#endif
+    return n;
+}
+
+/* Throughput of every ceil_log2_batch version on random values */
+static int bench_ceil_batch(size_t n, int reps)
+{
+    const char *names[3];
+    ceil_log2_batch_fn fns[3];
+    size_t nimpls = ceil_log2_batch_impls(names, fns);
+    uint64_t *tmp = malloc(n * sizeof(uint64_t));
+    uint32_t *in = malloc(n * sizeof(uint32_t));
+    uint8_t *ref = malloc(n), *out = malloc(n);
+    int ret = 0;
+
+    fill_values(tmp, n, 32);
+    for (size_t i = 0; i < n; i++)
+        in[i] = tmp[i];
+    free(tmp);
+
+    for (size_t i = 0; i < nimpls; i++) {
+        double t = now();
+
+        for (int r = 0; r < reps; r++)
+            fns[i](in, i ? out : ref, n);
+        t = now() - t;
+        printf("%-24s %12zu values %9.3f ms %9.2f Mvalues/s\n", names[i],
+               n * reps, t * 1e3, n * reps / t * 1e-6);
+
+        if (i && memcmp(ref, out, n)) {
+            printf("%s differs from scalar\n", names[i]);
+            ret = 1;
+        }
+    }
+
+    free(in);
+    free(ref);
+    free(out);
+    return ret;
+}
+
+/* Check every ceil_log2_batch version and the shift cascade against
+ * ceil_log2_32 on all 2^32 inputs
+ */
+static int test_exhaustive(void)
+{
+    enum { CHUNK = 1 << 16 };
+    const char *names[3];
+    ceil_log2_batch_fn fns[3];
+    size_t nimpls = ceil_log2_batch_impls(names, fns);
+    static uint32_t in[CHUNK];
+    static uint8_t ref[CHUNK], out[CHUNK];
+    int ret = 0;
+
+    for (uint64_t base = 0; base < (1ULL << 32); base += CHUNK) {
+        for (uint32_t i = 0; i < CHUNK; i++) {
+            in[i] = base + i;
+            ref[i] = ceil_log2_32(base + i);
+            if (ref[i] != ceil_log2_32_shift(base + i)) {
+                printf("ceil_log2_32_shift(%u) differs\n", in[i]);
+                return 1;
+            }
+        }
+
+        /* unaligned, odd lengths reach the scalar tails too */
+        for (size_t k = 0; k < nimpls; k++) {
+            size_t skip = base >> 16 & 7;
+
+            fns[k](in + skip, out + skip, CHUNK - skip - (base >> 19 & 31));
+            if (memcmp(ref + skip, out + skip,
+                       CHUNK - skip - (base >> 19 & 31))) {
+                printf("%s differs in [%llu, %llu)\n", names[k],
+                       (unsigned long long) base,
+                       (unsigned long long) base + CHUNK);
+                ret = 1;
+            }
+        }
+    }
+
+    if (!ret)
+        printf("all %zu versions match on 2^32 inputs\n", nimpls);
+    return ret;
 }
 
 int main(int argc, char *argv[])
 {
-    printf("%u\n", ceil_log2(0));
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench_log2(1 << 20, 64) | bench_ceil_batch(1 << 20, 64);
+    if (argc > 1 && !strcmp(argv[1], "exhaustive"))
+        return test_exhaustive();
+
+    printf("%u\n", ceil_log2_32(0));
     return 0;
 }
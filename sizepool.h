@@ -0,0 +1,220 @@
+#pragma once
+
+/*
+ * Size-class pool allocator
+ *
+ * Requests up to POOL_MAX_SIZE bytes are rounded up to a power of two and
+ * served from a free list per size class, indexed by ceil_log2(size). Each
+ * thread keeps its own free lists, so the common pool_alloc and pool_free are
+ * a few instructions without any atomic operation or lock. Only when a thread
+ * runs out of objects of a class, or has collected too many of them, a batch
+ * of POOL_BATCH objects moves between the thread and the shared lists, which
+ * are protected by a mutex per class. New objects are carved out of slabs
+ * taken from malloc, and slabs are never given back.
+ *
+ * The caller passes the size to pool_free as well, objects carry no header.
+ * Larger requests go to malloc and free directly.
+ *
+ * A thread which exits with objects in its free lists should call
+ * pool_thread_flush first, otherwise they are lost for other threads.
+ *
+ * Every translation unit which includes this header has its own pool.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "bitmath.h"
+
+#define POOL_MIN_SHIFT 4 /* 16 bytes, room for two free list links */
+#define POOL_MAX_SHIFT 12
+#define POOL_MAX_SIZE (1u << POOL_MAX_SHIFT)
+#define POOL_CLASSES (POOL_MAX_SHIFT + 1)
+#define POOL_BATCH 64
+#define POOL_SLAB_SIZE (64 * 1024)
+
+/* A free object. @next_batch links full batches in the shared lists. */
+struct pool_obj {
+    struct pool_obj *next;
+    struct pool_obj *next_batch;
+};
+
+struct pool_cache {
+    struct pool_obj *head;
+    unsigned int count;
+};
+
+struct pool_class {
+    pthread_mutex_t lock;
+    struct pool_obj *batches; /* lists of exactly POOL_BATCH objects */
+    struct pool_obj *loose;   /* objects from pool_thread_flush */
+    char *slab, *slab_end;    /* unused part of the newest slab */
+};
+
+static struct pool_class pool_classes[POOL_CLASSES] = {
+    [0 ... POOL_CLASSES - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+static __thread struct pool_cache pool_caches[POOL_CLASSES];
+
+static inline unsigned int pool_class_of(size_t size)
+{
+    unsigned int cls = ceil_log2_32(size);
+
+    return cls < POOL_MIN_SHIFT ? POOL_MIN_SHIFT : cls;
+}
+
+/* Take up to POOL_BATCH objects of @cls from the shared lists, carving a new
+ * slab when they are empty. Return: first object, NULL when out of memory
+ */
+static inline struct pool_obj *pool_refill(unsigned int cls,
+                                           unsigned int *count)
+{
+    struct pool_class *pc = &pool_classes[cls];
+    size_t size = (size_t) 1 << cls;
+    struct pool_obj *head = NULL, **tail = &head;
+    unsigned int n = 0;
+
+    pthread_mutex_lock(&pc->lock);
+    if (pc->batches) {
+        head = pc->batches;
+        pc->batches = head->next_batch;
+        n = POOL_BATCH;
+        goto out;
+    }
+
+    while (pc->loose && n < POOL_BATCH) {
+        *tail = pc->loose;
+        tail = &pc->loose->next;
+        pc->loose = pc->loose->next;
+        n++;
+    }
+    if (n)
+        goto done;
+
+    if ((size_t) (pc->slab_end - pc->slab) < size * POOL_BATCH) {
+        size_t slab_size = size * POOL_BATCH > POOL_SLAB_SIZE
+                               ? size * POOL_BATCH
+                               : POOL_SLAB_SIZE;
+
+        pc->slab = malloc(slab_size);
+        if (!pc->slab) {
+            pc->slab_end = NULL;
+            goto done;
+        }
+        pc->slab_end = pc->slab + slab_size;
+    }
+    for (; n < POOL_BATCH; n++) {
+        *tail = (struct pool_obj *) pc->slab;
+        tail = &(*tail)->next;
+        pc->slab += size;
+    }
+
+done:
+    *tail = NULL;
+out:
+    pthread_mutex_unlock(&pc->lock);
+    *count = n;
+    return head;
+}
+
+/* Move POOL_BATCH objects from the thread's list of @cls to the shared one */
+static inline void pool_flush_batch(struct pool_cache *cache, unsigned int cls)
+{
+    struct pool_class *pc = &pool_classes[cls];
+    struct pool_obj *batch = cache->head, *last = batch;
+
+    for (unsigned int i = 1; i < POOL_BATCH; i++)
+        last = last->next;
+    cache->head = last->next;
+    cache->count -= POOL_BATCH;
+    last->next = NULL;
+
+    pthread_mutex_lock(&pc->lock);
+    batch->next_batch = pc->batches;
+    pc->batches = batch;
+    pthread_mutex_unlock(&pc->lock);
+}
+
+/**
+ * pool_alloc() - Allocate memory from the size-class pool
+ * @size: number of bytes
+ *
+ * Return: pointer aligned to the smaller one of 16 and the size class, NULL
+ *  when out of memory
+ */
+static inline void *pool_alloc(size_t size)
+{
+    struct pool_cache *cache;
+    struct pool_obj *obj;
+    unsigned int cls;
+
+    if (size > POOL_MAX_SIZE)
+        return malloc(size);
+
+    cls = pool_class_of(size);
+    cache = &pool_caches[cls];
+    if (!cache->head) {
+        cache->head = pool_refill(cls, &cache->count);
+        if (!cache->head)
+            return NULL;
+    }
+
+    obj = cache->head;
+    cache->head = obj->next;
+    cache->count--;
+    return obj;
+}
+
+/**
+ * pool_free() - Give memory back to the size-class pool
+ * @ptr: pointer returned by pool_alloc, may be NULL
+ * @size: the size passed to pool_alloc
+ *
+ * The memory may be allocated and freed again in any thread.
+ */
+static inline void pool_free(void *ptr, size_t size)
+{
+    struct pool_cache *cache;
+    struct pool_obj *obj = ptr;
+    unsigned int cls;
+
+    if (size > POOL_MAX_SIZE || !ptr) {
+        free(ptr);
+        return;
+    }
+
+    cls = pool_class_of(size);
+    cache = &pool_caches[cls];
+    obj->next = cache->head;
+    cache->head = obj;
+    if (++cache->count >= 2 * POOL_BATCH)
+        pool_flush_batch(cache, cls);
+}
+
+/**
+ * pool_thread_flush() - Move all objects cached by the calling thread to the
+ *  shared lists
+ */
+static inline void pool_thread_flush(void)
+{
+    for (unsigned int cls = POOL_MIN_SHIFT; cls < POOL_CLASSES; cls++) {
+        struct pool_cache *cache = &pool_caches[cls];
+        struct pool_class *pc = &pool_classes[cls];
+        struct pool_obj *last = cache->head;
+
+        if (!last)
+            continue;
+        while (last->next)
+            last = last->next;
+
+        pthread_mutex_lock(&pc->lock);
+        last->next = pc->loose;
+        pc->loose = cache->head;
+        pthread_mutex_unlock(&pc->lock);
+
+        cache->head = NULL;
+        cache->count = 0;
+    }
+}
@@ -10,12 +10,28 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bptree.h"
+#include "sizepool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 typedef struct {
     struct __node *prev, *node;
@@ -28,6 +44,15 @@ typedef struct __node {
     long value;
 } node_t __attribute__((aligned(sizeof(long))));
 
+/* Statistics of a cmap. The event counters are only maintained when
+ * CMAP_STATS is defined, the shape fields are filled by cmap_get_stats.
+ * "total_depth / nodes" is the average number of nodes visited by a lookup.
+ */
+struct cmap_stats {
+    unsigned long inserts, rotations;
+    size_t nodes, height, total_depth;
+};
+
 struct cmap_internal {
     node_t *head;
 
@@ -36,9 +61,22 @@ struct cmap_internal {
 
     cmap_iter_t it_end, it_most, it_least;
 
+    /* Last inserted node, the default hint of cmap_insert_hint */
+    node_t *last;
+
     int (*comparator)(void *, void *);
+
+#ifdef CMAP_STATS
+    struct cmap_stats stats;
+#endif
 };
 
+#ifdef CMAP_STATS
+#define CMAP_STAT_INC(obj, counter) ((obj)->stats.counter++)
+#else
+#define CMAP_STAT_INC(obj, counter) ((void) (obj))
+#endif
+
 typedef enum { CMAP_RED = 0, CMAP_BLACK } color_t;
 
 #define rb_parent(r) ((node_t *) ((r)->color & ~1))
@@ -109,6 +147,24 @@ static inline void list_free(node_t **list)
     }
 }
 
+/* Same as list_make_node and list_free, with nodes from the size-class pool */
+static inline node_t *list_make_node_pool(node_t *list, int n)
+{
+    node_t *node = pool_alloc(sizeof(node_t));
+    node->value = n;
+    node->next = list;
+    return node;
+}
+
+static inline void list_free_pool(node_t **list)
+{
+    while (*list) {
+        node_t *next = (*list)->next;
+        pool_free(*list, sizeof(node_t));
+        *list = next;
+    }
+}
+
 static node_t *cmap_create_node(node_t *node)
 {
     /* Setup the pointers */
@@ -135,6 +191,8 @@ static inline node_t *cmap_rotate_left(cmap_t obj, node_t *node)
 {
     node_t *r = node->right, *rl = r->left, *up = rb_parent(node);
 
+    CMAP_STAT_INC(obj, rotations);
+
     /* Adjust */
     rb_set_parent(r, up);
     r->left = node;
@@ -172,6 +230,8 @@ static inline node_t *cmap_rotate_right(cmap_t obj, node_t *node)
 {
     node_t *l = node->left, *lr = l->right, *up = rb_parent(node);
 
+    CMAP_STAT_INC(obj, rotations);
+
     rb_set_parent(l, up);
     l->right = node;
 
@@ -371,10 +431,60 @@ static cmap_t cmap_new(size_t s1, size_t s2, int (*cmp)(void *, void *))
     obj->it_least.prev = obj->it_least.node = NULL;
     obj->it_most.prev = obj->it_most.node = NULL;
     obj->it_most.node = NULL;
+    obj->last = NULL;
+
+#ifdef CMAP_STATS
+    obj->stats = (struct cmap_stats){0};
+#endif
 
     return obj;
 }
 
+/* Link @node as the left or right child of @parent and fix the colors. The
+ * least and most iterators only move when the node is linked below them,
+ * rotations never change the smallest and the largest node.
+ */
+static void cmap_link(cmap_t obj, node_t *node, node_t *parent, bool left)
+{
+    if (left) {
+        parent->left = node;
+        if (parent == obj->it_least.node)
+            obj->it_least.node = node;
+    } else {
+        parent->right = node;
+        if (parent == obj->it_most.node)
+            obj->it_most.node = node;
+    }
+    rb_set_parent(node, parent);
+    cmap_fix_colors(obj, node);
+}
+
+/* Traverse the subtree of @cur until we hit the end or find a side that is
+ * NULL, and link @node there
+ */
+static void cmap_insert_below(cmap_t obj, node_t *node, node_t *cur)
+{
+    for (;;) {
+        int res = obj->comparator(&node->value, &cur->value);
+        if (!res) /* If the key matches something else, don't insert */
+            assert(0 && "not support repetitive value");
+
+        if (res < 0) {
+            if (!cur->left) {
+                cmap_link(obj, node, cur, true);
+                return;
+            }
+            cur = cur->left;
+        } else {
+            if (!cur->right) {
+                cmap_link(obj, node, cur, false);
+                return;
+            }
+            cur = cur->right;
+        }
+    }
+}
+
 /* Insert a key/value pair into the cmap. The value can be blank. If so,
  * it is filled with 0's, as defined in "cmap_create_node".
  */
@@ -383,6 +493,8 @@ static bool cmap_insert(cmap_t obj, node_t *node, void *value)
     cmap_create_node(node);
 
     obj->size++;
+    obj->last = node;
+    CMAP_STAT_INC(obj, inserts);
 
     if (!obj->head) {
         /* Just insert the node in as the new head. */
@@ -394,32 +506,62 @@ static bool cmap_insert(cmap_t obj, node_t *node, void *value)
         return true;
     }
 
-    /* Traverse the tree until we hit the end or find a side that is NULL */
-    for (node_t *cur = obj->head;;) {
-        int res = obj->comparator(&node->value, &cur->value);
-        if (!res) /* If the key matches something else, don't insert */
-            assert(0 && "not support repetitive value");
+    cmap_insert_below(obj, node, obj->head);
+    return true;
+}
 
-        if (res < 0) {
-            if (!cur->left) {
-                cur->left = node;
-                rb_set_parent(node, cur);
-                cmap_fix_colors(obj, node);
-                break;
-            }
-            cur = cur->left;
-        } else {
-            if (!cur->right) {
-                cur->right = node;
-                rb_set_parent(node, cur);
-                cmap_fix_colors(obj, node);
-                break;
-            }
-            cur = cur->right;
-        }
+/* Insert @node with the search starting at @hint instead of the root, NULL
+ * uses the last inserted node. A node which belongs behind the largest or in
+ * front of the smallest node is linked there directly. Otherwise the search
+ * climbs from @hint only until it reaches a subtree whose key range covers
+ * the new key. Sorted and nearly sorted streams are placed in amortized O(1).
+ */
+static UNUSED bool cmap_insert_hint(cmap_t obj, node_t *node, node_t *hint)
+{
+    node_t *top, *parent;
+    int res;
+
+    if (!hint)
+        hint = obj->last;
+    if (!hint)
+        return cmap_insert(obj, node, NULL);
+
+    cmap_create_node(node);
+
+    obj->size++;
+    obj->last = node;
+    CMAP_STAT_INC(obj, inserts);
+
+    res = obj->comparator(&node->value, &hint->value);
+    if (!res)
+        assert(0 && "not support repetitive value");
+
+    /* Climbing from a node next to the right or left spine would go up to
+     * the root for a new largest or smallest key, which gets linked directly
+     */
+    if (res > 0 && (hint == obj->it_most.node ||
+                    obj->comparator(&node->value,
+                                    &obj->it_most.node->value) > 0)) {
+        cmap_link(obj, node, obj->it_most.node, false);
+        return true;
+    }
+    if (res < 0 && (hint == obj->it_least.node ||
+                    obj->comparator(&node->value,
+                                    &obj->it_least.node->value) < 0)) {
+        cmap_link(obj, node, obj->it_least.node, true);
+        return true;
+    }
+
+    for (top = hint; (parent = rb_parent(top)); top = parent) {
+        if (res > 0 && top == parent->left &&
+            obj->comparator(&node->value, &parent->value) < 0)
+            break;
+        if (res < 0 && top == parent->right &&
+            obj->comparator(&node->value, &parent->value) > 0)
+            break;
     }
 
-    cmap_calibrate(obj);
+    cmap_insert_below(obj, node, top);
     return true;
 }
 
@@ -462,6 +604,358 @@ static node_t *cmap_next(node_t *node)
     return parent;
 }
 
+/* Find the node whose key compares equal to @key, NULL when there is none */
+static UNUSED node_t *cmap_find(cmap_t obj, void *key)
+{
+    node_t *node = obj->head;
+
+    while (node) {
+        int res = obj->comparator(key, &node->value);
+        if (!res)
+            return node;
+        node = res < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+/* Find the first node whose key is not smaller than @key */
+static UNUSED node_t *cmap_lower_bound(cmap_t obj, void *key)
+{
+    node_t *node = obj->head, *bound = NULL;
+
+    while (node) {
+        if (obj->comparator(&node->value, key) < 0) {
+            node = node->right;
+        } else {
+            bound = node;
+            node = node->left;
+        }
+    }
+    return bound;
+}
+
+#define CMAP_FIND_BATCH_LANES 16
+
+/* Look up @n keys, stored obj->key_size bytes apart, and set out[i] to the
+ * node matching key i or NULL. Up to CMAP_FIND_BATCH_LANES lookups advance in
+ * turns, one level per turn with the next node prefetched, so the cache misses
+ * of different lookups overlap instead of stalling one after another. A
+ * finished lookup hands its lane to the next key.
+ */
+static UNUSED void cmap_find_batch(cmap_t obj,
+                                   const void *keys,
+                                   size_t n,
+                                   node_t **out)
+{
+    struct {
+        node_t *node;
+        size_t i;
+    } lane[CMAP_FIND_BATCH_LANES];
+    size_t next = 0, active = 0;
+
+    for (; active < CMAP_FIND_BATCH_LANES && next < n; active++, next++) {
+        lane[active].node = obj->head;
+        lane[active].i = next;
+    }
+
+    while (active) {
+        for (size_t l = 0; l < active;) {
+            node_t *node = lane[l].node;
+            char *key = (char *) keys + lane[l].i * obj->key_size;
+            int res;
+
+            if (node && (res = obj->comparator(key, &node->value))) {
+                node = res < 0 ? node->left : node->right;
+                __builtin_prefetch(node);
+                lane[l++].node = node;
+                continue;
+            }
+
+            out[lane[l].i] = node;
+            if (next < n) {
+                lane[l].node = obj->head;
+                lane[l++].i = next++;
+            } else {
+                lane[l] = lane[--active];
+            }
+        }
+    }
+}
+
+/* Collect the counters and the current shape of the tree. The tree is walked
+ * via the parent pointers, so no recursion or stack is needed.
+ */
+static UNUSED void cmap_get_stats(cmap_t obj, struct cmap_stats *stats)
+{
+    node_t *node = obj->head, *prev = NULL, *next;
+    size_t depth = 1;
+
+#ifdef CMAP_STATS
+    *stats = obj->stats;
+#else
+    *stats = (struct cmap_stats){0};
+#endif
+    stats->nodes = stats->height = stats->total_depth = 0;
+
+    while (node) {
+        if (prev == rb_parent(node)) {
+            /* First visit, coming from above */
+            stats->nodes++;
+            stats->total_depth += depth;
+            if (depth > stats->height)
+                stats->height = depth;
+
+            next = node->left    ? node->left
+                   : node->right ? node->right
+                                 : rb_parent(node);
+        } else if (prev == node->left && node->right) {
+            next = node->right;
+        } else {
+            next = rb_parent(node);
+        }
+
+        if (next == rb_parent(node))
+            depth--;
+        else
+            depth++;
+
+        prev = node;
+        node = next;
+    }
+}
+
+/* A red-black tree is at most 2 * log2(n) high. Deeper recursion means the
+ * tree is broken.
+ */
+#define CMAP_VERIFY_MAX_HEIGHT 128
+
+/* Returns the black height of the subtree, or -1 when any invariant of the
+ * red-black tree is violated.
+ */
+static int cmap_verify_subtree(node_t *node, node_t *parent, int depth)
+{
+    if (!node)
+        return 1;
+
+    if (depth > CMAP_VERIFY_MAX_HEIGHT || rb_parent(node) != parent)
+        return -1;
+
+    /* A red node must not have a red child */
+    if (rb_is_red(node) && ((node->left && rb_is_red(node->left)) ||
+                            (node->right && rb_is_red(node->right))))
+        return -1;
+
+    int lh = cmap_verify_subtree(node->left, node, depth + 1);
+    int rh = cmap_verify_subtree(node->right, node, depth + 1);
+
+    /* Every path must contain the same number of black nodes */
+    if (lh < 0 || lh != rh)
+        return -1;
+
+    return lh + rb_is_black(node);
+}
+
+/* Check the whole tree: parent links, black root, no red-red edges, equal
+ * black height, strictly ascending in-order walk and the element count.
+ * The cost is O(n), so tree_sort only checks with CMAP_DEBUG defined.
+ */
+static UNUSED bool cmap_verify(cmap_t obj)
+{
+    size_t count = 0;
+
+    if (obj->head && !rb_is_black(obj->head))
+        return false;
+
+    if (cmap_verify_subtree(obj->head, NULL, 1) < 0)
+        return false;
+
+    for (node_t *node = cmap_first(obj), *next; node; node = next) {
+        next = cmap_next(node);
+        if (next && obj->comparator(&node->value, &next->value) >= 0)
+            return false;
+        count++;
+    }
+
+    return count == obj->size;
+}
+
+/* Immutable snapshot of a cmap for read-only lookups
+ *
+ * The keys are copied into one array in Eytzinger (BFS) order: the children
+ * of slot i are 2i and 2i + 1, so a search walks down an implicit tree
+ * without pointers. The first levels share a few cache lines, and the 16
+ * descendants four levels below slot i are the aligned line at 16i, which is
+ * prefetched while the current level is compared. The loop body has no
+ * unpredictable branch: every level shifts one comparison result into i, and
+ * the lower bound is recovered from the bits of i at the end (Khuong, Morin,
+ * "Array Layouts for Comparison-Based Searching").
+ *
+ * The snapshot orders keys as ints, like cmap_cmp_int, and keeps a pointer
+ * to the original node of every key. It stays valid while these nodes live,
+ * later changes of the cmap are not reflected.
+ */
+struct cmap_frozen {
+    size_t size;
+    int *keys;      /* keys[1 .. size], 64 byte aligned */
+    node_t **nodes; /* node of keys[i] */
+};
+
+static node_t *cmap_freeze_fill(struct cmap_frozen *f, node_t *node, size_t i)
+{
+    if (i > f->size)
+        return node;
+
+    node = cmap_freeze_fill(f, node, 2 * i);
+    f->keys[i] = node->value;
+    f->nodes[i] = node;
+    return cmap_freeze_fill(f, cmap_next(node), 2 * i + 1);
+}
+
+static UNUSED struct cmap_frozen *cmap_freeze(cmap_t obj)
+{
+    struct cmap_frozen *f = malloc(sizeof(*f));
+    size_t bytes = ((obj->size + 1) * sizeof(int) + 63) & ~(size_t) 63;
+
+    if (!f)
+        return NULL;
+    f->size = obj->size;
+    f->keys = aligned_alloc(64, bytes);
+    f->nodes = malloc((obj->size + 1) * sizeof(node_t *));
+    if (!f->keys || !f->nodes) {
+        free(f->keys);
+        free(f->nodes);
+        free(f);
+        return NULL;
+    }
+
+    f->keys[0] = 0;
+    f->nodes[0] = NULL; /* "not found" below */
+    cmap_freeze_fill(f, cmap_first(obj), 1);
+    return f;
+}
+
+static UNUSED void cmap_frozen_free(struct cmap_frozen *f)
+{
+    free(f->keys);
+    free(f->nodes);
+    free(f);
+}
+
+/* Slot of the first key not smaller than @key, 0 when there is none */
+static inline size_t cmap_frozen_search(const struct cmap_frozen *f, int key)
+{
+    size_t i = 1;
+
+    while (i <= f->size) {
+        __builtin_prefetch(f->keys + 16 * i);
+        i = 2 * i + (f->keys[i] < key);
+    }
+
+    /* drop the right turns after the last left turn */
+    return i >> __builtin_ffsll(~i);
+}
+
+static inline node_t *cmap_frozen_lower_bound(const struct cmap_frozen *f,
+                                              int key)
+{
+    return f->nodes[cmap_frozen_search(f, key)];
+}
+
+static inline node_t *cmap_frozen_find(const struct cmap_frozen *f, int key)
+{
+    size_t i = cmap_frozen_search(f, key);
+
+    return i && f->keys[i] == key ? f->nodes[i] : NULL;
+}
+
+/* cmap_frozen_lower_bound of @n keys. The searches advance in lock-step, 8
+ * at a time, so their cache misses overlap. With AVX2 the 8 searches are the
+ * lanes of a register and every level is one gather.
+ */
+#define CMAP_FROZEN_LANES 8
+
+static void cmap_frozen_lower_bound_scalar(const struct cmap_frozen *f,
+                                           const int *keys,
+                                           node_t **out,
+                                           size_t n)
+{
+    size_t g = 0;
+
+    for (; g + CMAP_FROZEN_LANES <= n; g += CMAP_FROZEN_LANES) {
+        size_t idx[CMAP_FROZEN_LANES];
+
+        for (int l = 0; l < CMAP_FROZEN_LANES; l++)
+            idx[l] = 1;
+        /* all lanes are on the same level, the last one may be partial */
+        for (bool active = true; active;) {
+            active = false;
+            for (int l = 0; l < CMAP_FROZEN_LANES; l++) {
+                if (idx[l] <= f->size) {
+                    idx[l] = 2 * idx[l] + (f->keys[idx[l]] < keys[g + l]);
+                    active = true;
+                }
+            }
+        }
+        for (int l = 0; l < CMAP_FROZEN_LANES; l++)
+            out[g + l] = f->nodes[idx[l] >> __builtin_ffsll(~idx[l])];
+    }
+
+    for (; g < n; g++)
+        out[g] = cmap_frozen_lower_bound(f, keys[g]);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2"))) static void cmap_frozen_lower_bound_avx2(
+    const struct cmap_frozen *f,
+    const int *keys,
+    node_t **out,
+    size_t n)
+{
+    const __m256i limit = _mm256_set1_epi32(f->size + 1);
+    size_t g = 0;
+
+    for (; g + 8 <= n; g += 8) {
+        __m256i key = _mm256_loadu_si256((const __m256i *) (keys + g));
+        __m256i i = _mm256_set1_epi32(1);
+        __m256i active;
+        uint32_t idx[8];
+
+        /* lanes with i <= size take one more step */
+        while (_mm256_movemask_epi8(
+            active = _mm256_cmpgt_epi32(limit, i))) {
+            __m256i v = _mm256_mask_i32gather_epi32(
+                _mm256_setzero_si256(), f->keys, i, active, 4);
+            __m256i right = _mm256_and_si256(_mm256_cmpgt_epi32(key, v),
+                                             active);
+
+            i = _mm256_sub_epi32(
+                _mm256_add_epi32(i, _mm256_and_si256(i, active)), right);
+        }
+
+        _mm256_storeu_si256((__m256i *) idx, i);
+        for (int l = 0; l < 8; l++)
+            out[g + l] = f->nodes[idx[l] >> __builtin_ffs(~idx[l])];
+    }
+
+    cmap_frozen_lower_bound_scalar(f, keys + g, out + g, n - g);
+}
+#endif
+
+static UNUSED void cmap_frozen_lower_bound_batch(const struct cmap_frozen *f,
+                                                 const int *keys,
+                                                 node_t **out,
+                                                 size_t n)
+{
+#ifdef HAVE_X86_SIMD
+    /* the lanes hold 32 bit slot numbers up to 2 * size + 1 */
+    if (f->size < (1u << 30) && __builtin_cpu_supports("avx2")) {
+        cmap_frozen_lower_bound_avx2(f, keys, out, n);
+        return;
+    }
+#endif
+    cmap_frozen_lower_bound_scalar(f, keys, out, n);
+}
+
 void tree_sort(node_t **list)
 {
     node_t **record = list;
@@ -470,6 +964,19 @@ void tree_sort(node_t **list)
         cmap_insert(map, *list, NULL);
         list = &(*list)->next;
     }
+#ifdef CMAP_DEBUG
+    assert(cmap_verify(map));
+#endif
+#ifdef CMAP_STATS
+    struct cmap_stats stats;
+    cmap_get_stats(map, &stats);
+    fprintf(stderr,
+            "tree_sort: %zu nodes, height %zu, avg depth %.2f, "
+            "rotations/insert %.3f\n",
+            stats.nodes, stats.height,
+            stats.nodes ? (double) stats.total_depth / stats.nodes : 0.0,
+            stats.inserts ? (double) stats.rotations / stats.inserts : 0.0);
+#endif
     node_t *node = cmap_first(map), *first = node;
     for (; node; node = cmap_next(node)) {
         *list = node;
@@ -480,42 +987,1791 @@ void tree_sort(node_t **list)
     free(map);
 }
 
-/* Verify if list is order */
-static bool list_is_ordered(node_t *list)
+/* tree_sort on a B+-tree instead of the cmap, with the nodes as values. The
+ * nodes are only touched to read the key and to link the result.
+ */
+void tree_sort_bptree(node_t **list)
 {
-    bool first = true;
-    int value;
-    while (list) {
-        if (first) {
-            value = list->value;
-            first = false;
-        } else {
-            if (list->value < value)
-                return false;
-            value = list->value;
+    struct bptree tree;
+    struct bptree_iter it;
+
+    bptree_init(&tree);
+    for (node_t *node = *list; node; node = node->next) {
+        if (bptree_insert(&tree, (int) node->value, node))
+            assert(0 && "not support repetitive value");
+    }
+    assert(bptree_verify(&tree));
+
+    bptree_for_each(it, &tree) {
+        *list = bptree_iter_value(&it);
+        list = &(*list)->next;
+    }
+    *list = NULL;
+    bptree_destroy(&tree);
+}
+
+/* External sort of a binary file of native int records
+ *
+ * The input is read in chunks which fit into @mem_limit bytes. Each chunk is
+ * sorted in memory and written to a temporary file as a sorted run. The runs
+ * are then merged k at a time, where every run gets an equal share of
+ * @mem_limit as read buffer so all I/O is large and sequential. When there are
+ * more runs than buffers of at least EXT_SORT_MIN_BUF bytes fit, the merge
+ * takes several passes.
+ *
+ * EXT_SORT_TREE sorts the chunks with tree_sort, which needs a node_t per
+ * record and, like tree_sort, distinct keys: a duplicate fails the assertion
+ * in cmap_insert, or with NDEBUG fails the sort with EINVAL. EXT_SORT_RADIX is
+ * an LSD radix sort which only needs a second int per record and allows
+ * duplicates.
+ *
+ * @mem_limit has to hold at least three buffers of EXT_SORT_MIN_BUF bytes, two
+ * runs and the output of a merge.
+ */
+enum ext_sort_mode { EXT_SORT_RADIX, EXT_SORT_TREE };
+
+#define EXT_SORT_MIN_BUF (256 * 1024)
+
+struct ext_sort_stats {
+    size_t records, runs, passes;
+};
+
+struct ext_run {
+    FILE *f;
+    int *buf;
+    size_t pos, len, cap;
+};
+
+/* sort @a by the bytes of the key with flipped sign bit, @tmp same size */
+static void radix_sort_int(int *a, int *tmp, size_t n)
+{
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t count[256] = {0}, sum = 0;
+
+        for (size_t i = 0; i < n; i++)
+            count[((uint32_t) a[i] ^ 0x80000000u) >> shift & 0xFF]++;
+        for (int b = 0; b < 256; b++) {
+            size_t c = count[b];
+            count[b] = sum;
+            sum += c;
         }
-        list = list->next;
+        for (size_t i = 0; i < n; i++)
+            tmp[count[((uint32_t) a[i] ^ 0x80000000u) >> shift & 0xFF]++] =
+                a[i];
+
+        int *t = a;
+        a = tmp;
+        tmp = t;
+    }
+    /* four passes, the result is back in the original array */
+}
+
+/* Sort @buf with tree_sort, @nodes holds @n nodes. With NDEBUG tree_sort
+ * keeps duplicate keys instead of asserting, so compare the neighbours.
+ * Return: false when @buf has duplicate keys
+ */
+static bool ext_sort_chunk_tree(int *buf, node_t *nodes, size_t n)
+{
+    node_t *list = NULL;
+    size_t len = 0;
+
+    for (size_t i = n; i--;) {
+        nodes[i].value = buf[i];
+        nodes[i].next = list;
+        list = &nodes[i];
+    }
+    tree_sort(&list);
+    for (; list; list = list->next) {
+        if (len && buf[len - 1] == list->value)
+            return false;
+        buf[len++] = list->value;
     }
     return true;
 }
 
-/* shuffle array, only work if n < RAND_MAX */
-static void shuffle(int *array, size_t n)
+static bool ext_run_fill(struct ext_run *run)
 {
-    if (n <= 1)
-        return;
+    run->pos = 0;
+    run->len = fread(run->buf, sizeof(int), run->cap, run->f);
+    return run->len > 0;
+}
 
-    for (size_t i = 0; i < n - 1; i++) {
-        size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
-        int t = array[j];
-        array[j] = array[i];
-        array[i] = t;
+/* sift @runs[i] down the min-heap of @k runs ordered by their current record */
+static void ext_heap_down(struct ext_run **heap, size_t k, size_t i)
+{
+    struct ext_run *run = heap[i];
+    int key = run->buf[run->pos];
+
+    for (size_t c; (c = 2 * i + 1) < k; i = c) {
+        if (c + 1 < k &&
+            heap[c + 1]->buf[heap[c + 1]->pos] < heap[c]->buf[heap[c]->pos])
+            c++;
+        if (key <= heap[c]->buf[heap[c]->pos])
+            break;
+        heap[i] = heap[c];
     }
+    heap[i] = run;
 }
 
-int main(int argc, char **argv)
+/* Merge the @k sorted runs into @out, using @mem_size bytes at @mem for the
+ * buffers. Return: 0 on success, -1 on an I/O error
+ */
+static int ext_merge(FILE **in, size_t k, FILE *out, int *mem, size_t mem_size)
 {
-    size_t count = 100;
+    size_t cap = mem_size / sizeof(int) / (k + 1), olen = 0, nheap = 0;
+    struct ext_run *runs = calloc(k, sizeof(*runs));
+    struct ext_run **heap = calloc(k, sizeof(*heap));
+    int *obuf = mem + k * cap;
+    int ret = 0;
+
+    if (!runs || !heap) {
+        ret = -1;
+        goto out;
+    }
+
+    for (size_t i = 0; i < k; i++) {
+        runs[i] = (struct ext_run){
+            .f = in[i], .buf = mem + i * cap, .cap = cap};
+        rewind(in[i]);
+        if (ext_run_fill(&runs[i]))
+            heap[nheap++] = &runs[i];
+        else if (ferror(in[i])) {
+            ret = -1;
+            goto out;
+        }
+    }
+    for (size_t i = nheap / 2; i--;)
+        ext_heap_down(heap, nheap, i);
+
+    while (nheap) {
+        struct ext_run *run = heap[0];
+
+        obuf[olen++] = run->buf[run->pos++];
+        if (olen == cap) {
+            if (fwrite(obuf, sizeof(int), olen, out) != olen) {
+                ret = -1;
+                goto out;
+            }
+            olen = 0;
+        }
+        if (run->pos == run->len && !ext_run_fill(run)) {
+            if (ferror(run->f)) {
+                ret = -1;
+                goto out;
+            }
+            heap[0] = heap[--nheap];
+        }
+        if (nheap)
+            ext_heap_down(heap, nheap, 0);
+    }
+    if (olen && fwrite(obuf, sizeof(int), olen, out) != olen)
+        ret = -1;
+
+out:
+    free(heap);
+    free(runs);
+    return ret;
+}
+
+/* Sort the records of @in into @out with at most about @mem_limit bytes of
+ * buffers. Return: 0 on success, -1 on an allocation or I/O error, or with
+ * errno set to EINVAL when @mem_limit is too small or EXT_SORT_TREE meets a
+ * duplicate key
+ */
+int tree_sort_file(FILE *in,
+                   FILE *out,
+                   size_t mem_limit,
+                   enum ext_sort_mode mode,
+                   struct ext_sort_stats *stats)
+{
+    size_t per_record =
+        sizeof(int) + (mode == EXT_SORT_TREE ? sizeof(node_t) : sizeof(int));
+    size_t chunk = mem_limit / per_record, fan_in, nruns = 0, n;
+    size_t max_runs = mem_limit / EXT_SORT_MIN_BUF - 1;
+    int *mem = NULL;
+    FILE **runs = NULL;
+    int ret = -1;
+
+    *stats = (struct ext_sort_stats){0};
+    if (mem_limit < 3 * EXT_SORT_MIN_BUF) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* the nodes after the first chunk ints have to be aligned */
+    chunk &= ~(_Alignof(node_t) / sizeof(int) - 1);
+    mem = malloc(mem_limit);
+    if (!mem)
+        goto out;
+
+    /* phase 1: sorted runs */
+    while ((n = fread(mem, sizeof(int), chunk, in)) > 0) {
+        FILE **grown = realloc(runs, (nruns + 1) * sizeof(*runs));
+
+        if (!grown)
+            goto out;
+        runs = grown;
+
+        if (mode == EXT_SORT_TREE) {
+            if (!ext_sort_chunk_tree(mem, (node_t *) (mem + chunk), n)) {
+                errno = EINVAL;
+                goto out;
+            }
+        } else {
+            radix_sort_int(mem, mem + chunk, n);
+        }
+
+        runs[nruns] = tmpfile();
+        if (!runs[nruns])
+            goto out;
+        nruns++;
+        if (fwrite(mem, sizeof(int), n, runs[nruns - 1]) != n)
+            goto out;
+        stats->records += n;
+    }
+    if (ferror(in))
+        goto out;
+    stats->runs = nruns;
+
+    /* phase 2: merge passes until the rest fits into one */
+    while (nruns > max_runs) {
+        size_t merged = 0;
+
+        for (size_t first = 0; first < nruns; first += max_runs) {
+            FILE *f = tmpfile();
+
+            fan_in = nruns - first < max_runs ? nruns - first : max_runs;
+            if (!f || ext_merge(runs + first, fan_in, f, mem, mem_limit)) {
+                if (f)
+                    fclose(f);
+                goto out;
+            }
+            for (size_t i = first; i < first + fan_in; i++) {
+                fclose(runs[i]);
+                runs[i] = NULL;
+            }
+            runs[merged++] = f;
+        }
+        nruns = merged;
+        stats->passes++;
+    }
+
+    if (ext_merge(runs, nruns, out, mem, mem_limit) || fflush(out))
+        goto out;
+    stats->passes++;
+    ret = 0;
+
+out:
+    for (size_t i = 0; i < nruns; i++)
+        if (runs[i])
+            fclose(runs[i]);
+    free(runs);
+    free(mem);
+    return ret;
+}
+
+/* Sort a file of fixed-size records through mmap
+ *
+ * Every record is @record_size bytes and starts with a native int64_t key.
+ * The input is mapped instead of read, and the output file is sized with
+ * ftruncate and filled through a shared mapping, so each record is copied
+ * once, from the input straight to its place in the output.
+ *
+ * EXT_SORT_TREE lays a node_t per record over one arena and runs tree_sort,
+ * so the keys have to be in the range of an int, otherwise the call fails with
+ * EINVAL. Like tree_sort it needs distinct keys: a duplicate fails the
+ * assertion in cmap_insert, or with NDEBUG fails the call with EINVAL.
+ * EXT_SORT_RADIX sorts an array of (key, record number) pairs by all 64 bits
+ * and allows duplicates.
+ */
+struct mmap_sort_entry {
+    uint64_t key; /* sign bit flipped, so it orders as unsigned */
+    size_t index;
+};
+
+/* LSD radix sort of @a by the bytes of the keys, skipping bytes which are the
+ * same in all keys. @tmp has room for @n entries as well.
+ * Return: the sorted array, either @a or @tmp
+ */
+static struct mmap_sort_entry *radix_sort_entries(struct mmap_sort_entry *a,
+                                                  struct mmap_sort_entry *tmp,
+                                                  size_t n)
+{
+    size_t count[8][256] = {{0}};
+
+    /* one pass for the histograms of all bytes */
+    for (size_t i = 0; i < n; i++)
+        for (int b = 0; b < 8; b++)
+            count[b][a[i].key >> (8 * b) & 0xFF]++;
+
+    for (int b = 0; b < 8; b++) {
+        size_t sum = 0;
+
+        if (count[b][a[0].key >> (8 * b) & 0xFF] == n)
+            continue;
+        for (int d = 0; d < 256; d++) {
+            size_t c = count[b][d];
+            count[b][d] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            tmp[count[b][a[i].key >> (8 * b) & 0xFF]++] = a[i];
+
+        struct mmap_sort_entry *t = a;
+        a = tmp;
+        tmp = t;
+    }
+    return a;
+}
+
+/* Sort the records of the file @in into the file @out, which has to be open
+ * for reading and writing. Return: 0 on success, -1 with errno set on an
+ * allocation or I/O error, EINVAL when the size of @in is not a multiple of
+ * @record_size or EXT_SORT_TREE gets keys it cannot sort
+ */
+int tree_sort_mmap(int in, int out, size_t record_size, enum ext_sort_mode mode)
+{
+    struct mmap_sort_entry *entries = NULL, *sorted;
+    char *src = MAP_FAILED, *dst = MAP_FAILED;
+    node_t *nodes = NULL;
+    struct stat st;
+    size_t n;
+    int ret = -1, err;
+
+    if (fstat(in, &st))
+        return -1;
+    if (record_size < sizeof(int64_t) || st.st_size % record_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    n = st.st_size / record_size;
+    if (ftruncate(out, st.st_size))
+        return -1;
+    if (!n)
+        return 0;
+
+    src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (src == MAP_FAILED)
+        goto out;
+    dst = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+    if (dst == MAP_FAILED)
+        goto out;
+
+    /* the keys are read in order, the records are gathered in any order */
+    madvise(src, st.st_size, MADV_SEQUENTIAL);
+    if (mode == EXT_SORT_TREE) {
+        node_t *list = nodes = malloc(n * sizeof(*nodes));
+
+        if (!nodes)
+            goto out;
+        for (size_t i = 0; i < n; i++) {
+            int64_t key;
+
+            memcpy(&key, src + i * record_size, sizeof(key));
+            if (key < INT_MIN || key > INT_MAX) {
+                errno = EINVAL;
+                goto out;
+            }
+            nodes[i].value = key;
+            nodes[i].next = &nodes[i + 1];
+        }
+        nodes[n - 1].next = NULL;
+        madvise(src, st.st_size, MADV_NORMAL);
+
+        tree_sort(&list);
+        for (char *p = dst; list; list = list->next, p += record_size) {
+            /* with NDEBUG tree_sort keeps duplicates instead of asserting */
+            if (list->next && list->next->value == list->value) {
+                errno = EINVAL;
+                goto out;
+            }
+            memcpy(p, src + (list - nodes) * record_size, record_size);
+        }
+    } else {
+        entries = malloc(2 * n * sizeof(*entries));
+        if (!entries)
+            goto out;
+        for (size_t i = 0; i < n; i++) {
+            int64_t key;
+
+            memcpy(&key, src + i * record_size, sizeof(key));
+            entries[i].key = (uint64_t) key ^ (1ULL << 63);
+            entries[i].index = i;
+        }
+        madvise(src, st.st_size, MADV_NORMAL);
+
+        sorted = radix_sort_entries(entries, entries + n, n);
+        if (record_size == sizeof(int64_t)) {
+            /* bare keys, no need to go back to the input */
+            for (size_t i = 0; i < n; i++) {
+                int64_t key = sorted[i].key ^ (1ULL << 63);
+
+                memcpy(dst + i * record_size, &key, sizeof(key));
+            }
+        } else {
+            for (size_t i = 0; i < n; i++)
+                memcpy(dst + i * record_size,
+                       src + sorted[i].index * record_size, record_size);
+        }
+    }
+    ret = 0;
+
+out:
+    err = errno;
+    if (dst != MAP_FAILED && munmap(dst, st.st_size) && !ret) {
+        err = errno;
+        ret = -1;
+    }
+    if (src != MAP_FAILED)
+        munmap(src, st.st_size);
+    free(entries);
+    free(nodes);
+    errno = err;
+    return ret;
+}
+
+/* Sorted map file, a snapshot of an ordered map which is used through mmap
+ *
+ * Layout, all integers in native byte order:
+ *
+ *   0                     struct smap_header, padded to SMAP_PAGE bytes
+ *   records_off           count x struct smap_record, ascending keys
+ *   index_off             index_count x int64_t, the first key of every
+ *                         SMAP_PAGE bytes of records
+ *
+ * The file holds offsets only, no pointers, so it works at any address and
+ * needs no deserialization. In-order iteration walks the records. A lookup
+ * searches the index, which is 1/256 of the records and stays cached, and then
+ * a single page of records, so a cold lookup faults in one page of records.
+ */
+#define SMAP_MAGIC 0x50414d53 /* "SMAP" */
+#define SMAP_VERSION 1
+#define SMAP_PAGE 4096
+
+struct smap_header {
+    uint32_t magic, version;
+    uint64_t count;
+    uint64_t records_off;
+    uint64_t index_off, index_count;
+};
+
+struct smap_record {
+    int64_t key, value;
+};
+
+#define SMAP_PAGE_RECORDS (SMAP_PAGE / sizeof(struct smap_record))
+
+struct smap_writer {
+    FILE *out;
+    uint64_t count;
+    int64_t last;
+    int64_t *index;
+    size_t index_count, index_size;
+};
+
+/* A mapped file. @records and @index point into the mapping. */
+struct smap {
+    void *base;
+    size_t len;
+    uint64_t count, index_count;
+    const struct smap_record *records;
+    const int64_t *index;
+};
+
+/* Start writing a map file to @out, which must be seekable */
+static int smap_write_begin(struct smap_writer *w, FILE *out)
+{
+    static const char header[SMAP_PAGE];
+
+    *w = (struct smap_writer){.out = out};
+    return fwrite(header, SMAP_PAGE, 1, out) == 1 ? 0 : -1;
+}
+
+/* Append a record, the keys have to be written in ascending order */
+static int smap_write(struct smap_writer *w, int64_t key, int64_t value)
+{
+    struct smap_record rec = {key, value};
+
+    if (w->count && key <= w->last) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (w->count % SMAP_PAGE_RECORDS == 0) {
+        if (w->index_count == w->index_size) {
+            size_t size = w->index_size ? 2 * w->index_size : 1024;
+            int64_t *index = realloc(w->index, size * sizeof(int64_t));
+
+            if (!index)
+                return -1;
+            w->index = index;
+            w->index_size = size;
+        }
+        w->index[w->index_count++] = key;
+    }
+    if (fwrite(&rec, sizeof(rec), 1, w->out) != 1)
+        return -1;
+    w->last = key;
+    w->count++;
+    return 0;
+}
+
+/* Write the index and the header */
+static int smap_write_end(struct smap_writer *w)
+{
+    struct smap_header hdr = {
+        .magic = SMAP_MAGIC,
+        .version = SMAP_VERSION,
+        .count = w->count,
+        .records_off = SMAP_PAGE,
+        .index_off = SMAP_PAGE + w->count * sizeof(struct smap_record),
+        .index_count = w->index_count,
+    };
+    int ret = -1;
+
+    if (fwrite(w->index, sizeof(int64_t), w->index_count, w->out) ==
+            w->index_count &&
+        !fseek(w->out, 0, SEEK_SET) &&
+        fwrite(&hdr, sizeof(hdr), 1, w->out) == 1 && !fflush(w->out))
+        ret = 0;
+    free(w->index);
+    w->index = NULL;
+    return ret;
+}
+
+/* Save the keys of a cmap of int keys, the values are 0 */
+static UNUSED int cmap_save(cmap_t obj, FILE *out)
+{
+    struct smap_writer w;
+
+    if (smap_write_begin(&w, out))
+        return -1;
+    for (node_t *node = cmap_first(obj); node; node = cmap_next(node)) {
+        if (smap_write(&w, (int) node->value, 0)) {
+            free(w.index);
+            return -1;
+        }
+    }
+    return smap_write_end(&w);
+}
+
+/* Map a file written by smap_write_end read-only. The header and the section
+ * bounds are checked, the content is trusted.
+ */
+static int smap_open(struct smap *m, const char *path)
+{
+    const struct smap_header *hdr;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    if ((uint64_t) st.st_size < SMAP_PAGE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    m->len = st.st_size;
+    m->base = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m->base == MAP_FAILED)
+        return -1;
+
+    hdr = m->base;
+    if (hdr->magic != SMAP_MAGIC || hdr->version != SMAP_VERSION ||
+        hdr->records_off % sizeof(int64_t) ||
+        hdr->index_off % sizeof(int64_t) || hdr->records_off > m->len ||
+        hdr->count > (m->len - hdr->records_off) / sizeof(struct smap_record) ||
+        hdr->index_off > m->len ||
+        hdr->index_count > (m->len - hdr->index_off) / sizeof(int64_t) ||
+        hdr->index_count !=
+            (hdr->count + SMAP_PAGE_RECORDS - 1) / SMAP_PAGE_RECORDS) {
+        munmap(m->base, m->len);
+        errno = EINVAL;
+        return -1;
+    }
+    m->count = hdr->count;
+    m->index_count = hdr->index_count;
+    m->records = (const void *) ((const char *) m->base + hdr->records_off);
+    m->index = (const void *) ((const char *) m->base + hdr->index_off);
+    return 0;
+}
+
+static void smap_close(struct smap *m)
+{
+    munmap(m->base, m->len);
+}
+
+/* Position of the first record whose key is not smaller than @key, m->count
+ * when there is none
+ */
+static size_t smap_lower_bound(const struct smap *m, int64_t key)
+{
+    size_t lo = 0, n = m->index_count, end;
+
+    /* the last page whose first key is not larger than @key */
+    while (n > 1) {
+        size_t half = n / 2;
+
+        if (m->index[lo + half] <= key)
+            lo += half;
+        n -= half;
+    }
+
+    end = (lo + 1) * SMAP_PAGE_RECORDS;
+    end = end < m->count ? end : m->count;
+    lo *= SMAP_PAGE_RECORDS;
+    for (n = end - lo; n > 1;) {
+        size_t half = n / 2;
+
+        if (m->records[lo + half - 1].key < key)
+            lo += half;
+        n -= half;
+    }
+    return lo < end && m->records[lo].key < key ? lo + 1 : lo;
+}
+
+/* Record of @key, NULL when it is not in the map */
+static const struct smap_record *smap_find(const struct smap *m, int64_t key)
+{
+    size_t pos = smap_lower_bound(m, key);
+
+    return pos < m->count && m->records[pos].key == key ? &m->records[pos]
+                                                        : NULL;
+}
+
+/* K-way merge of sorted lists
+ *
+ * Every input list is represented by its current head. The smallest head is
+ * unlinked, appended to the output and replaced by its successor, so the nodes
+ * are relinked in place and never copied. Selecting the smallest head is
+ * O(log k) with either of two structures:
+ *
+ * - MERGE_PRIO_QUEUE: the balanced avl_prio_queue of avltree.c, which keeps a
+ *   pointer to the minimum. Every step erases the minimum and inserts the
+ *   successor.
+ * - MERGE_LOSER_TREE: a tournament tree whose inner nodes hold the loser of
+ *   the match below them. The successor of the winner only replays the
+ *   matches on its path to the root, one comparison per level.
+ */
+#include "avltree.h"
+
+/* the key is a long like node_t.value, so merged values keep their order */
+struct avlitem {
+    long i;
+    struct avl_node avl;
+};
+
+static inline int cmpint(const void *p1, const void *p2)
+{
+    long i1 = *(long *) p1;
+    long i2 = *(long *) p2;
+
+    return (i1 > i2) - (i1 < i2);
+}
+
+#include "avltree.c"
+
+enum merge_mode { MERGE_PRIO_QUEUE, MERGE_LOSER_TREE };
+
+struct merge_src {
+    struct avlitem item; /* item.i is the value of the head */
+    node_t *head;
+};
+
+static node_t *list_merge_prio_queue(node_t **lists, size_t k)
+{
+    struct merge_src *srcs = malloc(k * sizeof(*srcs));
+    struct avl_prio_queue queue;
+    struct avlitem *item;
+    node_t *merged = NULL, **tail = &merged;
+
+    if (!srcs)
+        return NULL;
+    avl_prio_queue_init(&queue);
+    for (size_t i = 0; i < k; i++) {
+        if (!lists[i])
+            continue;
+        srcs[i].head = lists[i];
+        srcs[i].item.i = lists[i]->value;
+        avl_prio_queue_insert_balanced(&queue, &srcs[i].item);
+    }
+
+    while ((item = avl_prio_queue_pop_balanced(&queue))) {
+        struct merge_src *src = container_of(item, struct merge_src, item);
+
+        *tail = src->head;
+        tail = &src->head->next;
+        src->head = src->head->next;
+        if (src->head) {
+            item->i = src->head->value;
+            avl_prio_queue_insert_balanced(&queue, item);
+        }
+    }
+    *tail = NULL;
+
+    free(srcs);
+    return merged;
+}
+
+/* true when the head of list @a has to go before the one of list @b, empty
+ * lists are larger than everything
+ */
+static inline bool loser_tree_less(node_t **heads, size_t a, size_t b)
+{
+    if (!heads[a])
+        return false;
+    return !heads[b] || heads[a]->value < heads[b]->value ||
+           (heads[a]->value == heads[b]->value && a < b);
+}
+
+static node_t *list_merge_loser_tree(node_t **lists, size_t k)
+{
+    size_t leaves = (size_t) 1 << ceil_log2_64(k);
+    node_t **heads = calloc(leaves, sizeof(*heads));
+    size_t *tree = malloc(leaves * sizeof(*tree));
+    size_t *win = malloc(2 * leaves * sizeof(*win));
+    node_t *merged = NULL, **tail = &merged;
+    size_t winner;
+
+    if (!heads || !tree || !win) {
+        free(win);
+        free(tree);
+        free(heads);
+        return NULL;
+    }
+    memcpy(heads, lists, k * sizeof(*heads));
+
+    /* play all matches bottom up, node leaves + i is list i */
+    for (size_t i = 0; i < leaves; i++)
+        win[leaves + i] = i;
+    for (size_t p = leaves; --p;) {
+        size_t a = win[2 * p], b = win[2 * p + 1];
+        bool b_wins = loser_tree_less(heads, b, a);
+
+        win[p] = b_wins ? b : a;
+        tree[p] = b_wins ? a : b;
+    }
+    winner = win[1];
+    free(win);
+
+    while (heads[winner]) {
+        *tail = heads[winner];
+        tail = &heads[winner]->next;
+        heads[winner] = heads[winner]->next;
+
+        /* replay the path of the winner's list to the root */
+        for (size_t p = (leaves + winner) / 2; p; p /= 2) {
+            if (loser_tree_less(heads, tree[p], winner)) {
+                size_t t = tree[p];
+                tree[p] = winner;
+                winner = t;
+            }
+        }
+    }
+    *tail = NULL;
+
+    free(tree);
+    free(heads);
+    return merged;
+}
+
+/* Merge the @k sorted @lists into one sorted list.
+ * Return: the merged list, NULL when all lists are empty, or NULL with errno
+ * set to ENOMEM and the lists untouched when out of memory
+ */
+node_t *list_merge_k(node_t **lists, size_t k, enum merge_mode mode)
+{
+    if (mode == MERGE_LOSER_TREE)
+        return list_merge_loser_tree(lists, k);
+    return list_merge_prio_queue(lists, k);
+}
+
+/* Verify if list is order */
+static bool list_is_ordered(node_t *list)
+{
+    bool first = true;
+    int value;
+    while (list) {
+        if (first) {
+            value = list->value;
+            first = false;
+        } else {
+            if (list->value < value)
+                return false;
+            value = list->value;
+        }
+        list = list->next;
+    }
+    return true;
+}
+
+/* shuffle array, only work if n < RAND_MAX */
+static void shuffle(int *array, size_t n)
+{
+    if (n <= 1)
+        return;
+
+    for (size_t i = 0; i < n - 1; i++) {
+        size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
+        int t = array[j];
+        array[j] = array[i];
+        array[i] = t;
+    }
+}
+
+/* Like shuffle, but every key is only swapped with one of the next
+ * @window - 1 keys, so the array stays nearly sorted
+ */
+static void jitter(int *array, size_t n, size_t window)
+{
+    for (size_t i = 0; i + 1 < n && window > 1; i++) {
+        size_t j = i + rand() % window;
+        int t;
+
+        if (j >= n)
+            j = n - 1;
+        t = array[j];
+        array[j] = array[i];
+        array[i] = t;
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report_op(const char *name, size_t n, size_t ops, double elapsed)
+{
+    printf("%-20s n=%-10zu %9.3f ms %8.1f ns/op\n", name, n, elapsed * 1e3,
+           elapsed / ops * 1e9);
+}
+
+/* Build, sort and free lists of @count nodes @rounds times, with the nodes
+ * from malloc and from the size-class pool
+ */
+static int bench_alloc(size_t count, int rounds)
+{
+    int *arr = malloc(sizeof(int) * count);
+    int ret = 0;
+
+    for (size_t i = 0; i < count; i++)
+        arr[i] = i;
+    shuffle(arr, count);
+
+    for (int pool = 0; pool < 2; pool++) {
+        double t_build = 0, t_sort = 0, t_free = 0, t;
+
+        for (int r = 0; r < rounds; r++) {
+            node_t *list = NULL;
+
+            t = now();
+            for (size_t i = count; i--;)
+                list = pool ? list_make_node_pool(list, arr[i])
+                            : list_make_node(list, arr[i]);
+            t_build += now() - t;
+
+            t = now();
+            tree_sort(&list);
+            t_sort += now() - t;
+            if (!list_is_ordered(list))
+                ret = 1;
+
+            t = now();
+            if (pool)
+                list_free_pool(&list);
+            else
+                list_free(&list);
+            t_free += now() - t;
+        }
+
+        printf("%-8s %zu nodes x %d: build %.3f ms sort %.3f ms free %.3f ms "
+               "total %.3f ms\n",
+               pool ? "pool" : "malloc", count, rounds, t_build * 1e3 / rounds,
+               t_sort * 1e3 / rounds, t_free * 1e3 / rounds,
+               (t_build + t_sort + t_free) * 1e3 / rounds);
+    }
+
+    free(arr);
+    return ret;
+}
+
+/* Merge @n nodes spread randomly over k sorted lists, for k = 2 .. 4096, with
+ * both merge modes, against concatenating the lists and running tree_sort
+ */
+static int bench_merge(size_t n)
+{
+    node_t *nodes = malloc(n * sizeof(*nodes));
+    node_t **lists = malloc(4096 * sizeof(*lists));
+    node_t ***tails = malloc(4096 * sizeof(*tails));
+    uint64_t seed = 88172645463325252ULL;
+    int ret = 0;
+
+    /* values beyond the int range, 1L << 32 must not sort as 0 */
+    for (int mode = MERGE_PRIO_QUEUE; mode <= MERGE_LOSER_TREE; mode++) {
+        node_t wide[3] = {{.value = -1}, {.value = 1L << 32}, {.value = 5}};
+        node_t *heads[2] = {&wide[0], &wide[2]}, *merged;
+
+        wide[0].next = &wide[1];
+        wide[1].next = wide[2].next = NULL;
+        merged = list_merge_k(heads, 2, mode);
+        if (merged != &wide[0] || wide[0].next != &wide[2] ||
+            wide[2].next != &wide[1] || wide[1].next) {
+            printf("merge misorders values beyond the int range\n");
+            ret = 1;
+        }
+    }
+
+    for (size_t k = 2; k <= 4096; k *= 2) {
+        for (int mode = -1; mode <= MERGE_LOSER_TREE; mode++) {
+            node_t *merged;
+            size_t count = 0;
+            double t;
+
+            /* ascending values, each appended to a random list */
+            for (size_t j = 0; j < k; j++) {
+                lists[j] = NULL;
+                tails[j] = &lists[j];
+            }
+            for (size_t i = 0; i < n; i++) {
+                size_t j;
+
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                j = seed % k;
+                nodes[i].value = i;
+                *tails[j] = &nodes[i];
+                tails[j] = &nodes[i].next;
+            }
+            for (size_t j = 0; j < k; j++)
+                *tails[j] = NULL;
+
+            t = now();
+            if (mode < 0) {
+                /* the old way, only once since it does not depend on k */
+                if (k != 2)
+                    continue;
+                for (size_t j = 0; j + 1 < k; j++)
+                    *tails[j] = lists[j + 1];
+                merged = lists[0];
+                tree_sort(&merged);
+            } else {
+                merged = list_merge_k(lists, k, mode);
+                if (!merged) {
+                    perror("list_merge_k");
+                    return 1;
+                }
+            }
+            t = now() - t;
+
+            for (node_t *node = merged; node; node = node->next)
+                count++;
+            if (count != n || !list_is_ordered(merged)) {
+                printf("merge k=%zu lost or misordered nodes\n", k);
+                ret = 1;
+            }
+            printf("merge %-10s k=%-5zu %zu nodes %9.3f ms %8.2f Mnodes/s\n",
+                   mode < 0                     ? "tree_sort"
+                   : mode == MERGE_LOSER_TREE ? "loser tree"
+                                              : "prio queue",
+                   k, n, t * 1e3, n / t * 1e-6);
+        }
+    }
+
+    free(tails);
+    free(lists);
+    free(nodes);
+    return ret;
+}
+
+/* Lookups in cmap against its frozen snapshot for 10^6 .. 10^max_pow10 keys.
+ * The keys are the even numbers, half of the random lookups miss.
+ */
+static int bench_freeze(int max_pow10, size_t lookups)
+{
+    if (max_pow10 < 6) {
+        printf("freeze starts at 10^6 keys, max_pow10 must be at least 6\n");
+        return 1;
+    }
+
+    int *queries = malloc(lookups * sizeof(int));
+    node_t **expect = malloc(lookups * sizeof(node_t *));
+    node_t **got = malloc(lookups * sizeof(node_t *));
+    uint64_t seed = 2463534242ULL;
+    size_t n = 1000000;
+    int ret = 0;
+
+    for (int p = 6; p <= max_pow10; n *= 10, p++) {
+        node_t *nodes = malloc(n * sizeof(*nodes));
+        cmap_t map = cmap_new(sizeof(long), sizeof(NULL), cmap_cmp_int);
+        struct cmap_frozen *f;
+        size_t hits = 0;
+        double t;
+
+        for (size_t i = 0; i < n; i++) {
+            /* the constant is coprime to 10^k, a permutation modulo n */
+            nodes[i].value = (int) ((uint64_t) i * 2654435761u % n) * 2;
+            cmap_insert(map, &nodes[i], NULL);
+        }
+        for (size_t i = 0; i < lookups; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            queries[i] = seed % (2 * n + 2);
+        }
+
+        t = now();
+        f = cmap_freeze(map);
+        printf("freeze   n=%-10zu %9.3f ms\n", n, (now() - t) * 1e3);
+
+        t = now();
+        for (size_t i = 0; i < lookups; i++)
+            expect[i] = cmap_lower_bound(map, &queries[i]);
+        report_op("cmap lower_bound", n, lookups, now() - t);
+
+        t = now();
+        for (size_t i = 0; i < lookups; i++)
+            hits += cmap_find(map, &queries[i]) != NULL;
+        report_op("cmap find", n, lookups, now() - t);
+
+        t = now();
+        for (size_t i = 0; i < lookups; i++)
+            got[i] = cmap_frozen_lower_bound(f, queries[i]);
+        report_op("frozen lower_bound", n, lookups, now() - t);
+        if (memcmp(got, expect, lookups * sizeof(node_t *)))
+            ret = 1;
+
+        t = now();
+        for (size_t i = 0; i < lookups; i++)
+            hits -= cmap_frozen_find(f, queries[i]) != NULL;
+        report_op("frozen find", n, lookups, now() - t);
+        if (hits)
+            ret = 1;
+
+        memset(got, 0, lookups * sizeof(node_t *));
+        t = now();
+        cmap_frozen_lower_bound_scalar(f, queries, got, lookups);
+        report_op("frozen batch scalar", n, lookups, now() - t);
+        if (memcmp(got, expect, lookups * sizeof(node_t *)))
+            ret = 1;
+
+        memset(got, 0, lookups * sizeof(node_t *));
+        t = now();
+        cmap_frozen_lower_bound_batch(f, queries, got, lookups);
+        report_op("frozen batch", n, lookups, now() - t);
+        if (memcmp(got, expect, lookups * sizeof(node_t *)))
+            ret = 1;
+
+        if (ret)
+            printf("frozen lookups differ from cmap\n");
+        cmap_frozen_free(f);
+        free(map);
+        free(nodes);
+    }
+
+    free(queries);
+    free(expect);
+    free(got);
+    return ret;
+}
+
+static void avlitem_insert(struct avl_root *root, struct avlitem *new_entry)
+{
+    struct avl_node *parent = NULL;
+    struct avl_node **cur_nodep = &root->node;
+
+    while (*cur_nodep) {
+        struct avlitem *cur_entry = avl_entry(*cur_nodep, struct avlitem, avl);
+
+        parent = *cur_nodep;
+        if (cmpint(&new_entry->i, &cur_entry->i) <= 0)
+            cur_nodep = &parent->left;
+        else
+            cur_nodep = &parent->right;
+    }
+
+    avl_insert(&new_entry->avl, parent, cur_nodep, root);
+}
+
+static int avlitem_cmp_node(const struct avl_node *a, const struct avl_node *b)
+{
+    return cmpint(&avl_entry(a, struct avlitem, avl)->i,
+                  &avl_entry(b, struct avlitem, avl)->i);
+}
+
+/* @key points to a long, the type of avlitem.i */
+static int avlitem_cmp_key(const void *key, const struct avl_node *node)
+{
+    return cmpint(key, &avl_entry(node, struct avlitem, avl)->i);
+}
+
+static struct avlitem *avlitem_find(struct avl_root *root, long key)
+{
+    struct avl_node *node = root->node;
+
+    while (node) {
+        struct avlitem *item = avl_entry(node, struct avlitem, avl);
+        int c = cmpint(&key, &item->i);
+
+        if (!c)
+            return item;
+        node = c < 0 ? node->left : node->right;
+    }
+    return NULL;
+}
+
+/* Insert, find and iterate @n shuffled keys in cmap, the avl tree and the
+ * B+-tree, then tree_sort against tree_sort_bptree on the same list
+ */
+static int bench_bptree(size_t n)
+{
+    int *keys = malloc(n * sizeof(int)), *queries = malloc(n * sizeof(int));
+    node_t *nodes = malloc(n * sizeof(*nodes)), *list;
+    struct avlitem *items = malloc(n * sizeof(*items));
+    cmap_t map = cmap_new(sizeof(long), sizeof(NULL), cmap_cmp_int);
+    struct avl_root root;
+    struct bptree tree;
+    struct bptree_iter it;
+    size_t found[3] = {0}, visited[3] = {0};
+    long sum[3] = {0};
+    double t;
+    int ret = 0;
+
+    for (size_t i = 0; i < n; i++)
+        keys[i] = queries[i] = i;
+    shuffle(keys, n);
+    shuffle(queries, n);
+    INIT_AVL_ROOT(&root);
+    bptree_init(&tree);
+
+    t = now();
+    for (size_t i = 0; i < n; i++) {
+        nodes[i].value = keys[i];
+        cmap_insert(map, &nodes[i], NULL);
+    }
+    report_op("cmap insert", n, n, now() - t);
+    t = now();
+    for (size_t i = 0; i < n; i++) {
+        items[i].i = keys[i];
+        avlitem_insert(&root, &items[i]);
+    }
+    report_op("avl insert", n, n, now() - t);
+    t = now();
+    for (size_t i = 0; i < n; i++)
+        ret |= bptree_insert(&tree, keys[i], &nodes[i]);
+    report_op("bptree insert", n, n, now() - t);
+    for (struct bptree_leaf *leaf = tree.first; leaf; leaf = leaf->next)
+        visited[2]++;
+    printf("bptree height %u, %.1f keys per leaf\n", tree.height,
+           (double) n / visited[2]);
+    visited[2] = 0;
+
+    t = now();
+    for (size_t i = 0; i < n; i++)
+        found[0] += cmap_find(map, &queries[i]) != NULL;
+    report_op("cmap find", n, n, now() - t);
+    t = now();
+    for (size_t i = 0; i < n; i++)
+        found[1] += avlitem_find(&root, queries[i]) != NULL;
+    report_op("avl find", n, n, now() - t);
+    t = now();
+    for (size_t i = 0; i < n; i++)
+        found[2] += bptree_find(&tree, queries[i]) != NULL;
+    report_op("bptree find", n, n, now() - t);
+
+    t = now();
+    for (node_t *node = cmap_first(map); node; node = cmap_next(node)) {
+        sum[0] += node->value;
+        visited[0]++;
+    }
+    report_op("cmap iterate", n, n, now() - t);
+    t = now();
+    for (struct avl_node *node = avl_first(&root); node;
+         node = avl_next(node)) {
+        sum[1] += avl_entry(node, struct avlitem, avl)->i;
+        visited[1]++;
+    }
+    report_op("avl iterate", n, n, now() - t);
+    t = now();
+    bptree_for_each(it, &tree) {
+        sum[2] += bptree_iter_key(&it);
+        visited[2]++;
+    }
+    report_op("bptree iterate", n, n, now() - t);
+
+    for (int i = 0; i < 3; i++) {
+        if (found[i] != n || visited[i] != n || sum[i] != sum[0])
+            ret = 1;
+    }
+    if (!bptree_verify(&tree))
+        ret = 1;
+    bptree_destroy(&tree);
+    free(map);
+
+    for (int b = 0; b < 2; b++) {
+        list = NULL;
+        for (size_t i = n; i--;) {
+            nodes[i].next = list;
+            list = &nodes[i];
+        }
+        t = now();
+        if (b)
+            tree_sort_bptree(&list);
+        else
+            tree_sort(&list);
+        report_op(b ? "tree_sort_bptree" : "tree_sort", n, n, now() - t);
+        if (!list_is_ordered(list))
+            ret = 1;
+    }
+
+    if (ret)
+        printf("bptree results differ\n");
+    free(keys);
+    free(queries);
+    free(nodes);
+    free(items);
+    return ret;
+}
+
+/* Random lookups in cmap and the avl tree with @n keys, for n = 10^5 .. 10^7,
+ * one by one against the batched versions. The keys are the even numbers, so
+ * half of the lookups miss.
+ */
+static int bench_find_batch(int max_pow10, size_t lookups)
+{
+    long *queries = malloc(lookups * sizeof(long));
+    void **expect = malloc(lookups * sizeof(void *));
+    void **got = malloc(lookups * sizeof(void *));
+    size_t n = 100000;
+    int ret = 0;
+
+    for (int p = 5; p <= max_pow10; n *= 10, p++) {
+        node_t *nodes = malloc(n * sizeof(*nodes));
+        struct avlitem *items = malloc(n * sizeof(*items));
+        cmap_t map = cmap_new(sizeof(long), sizeof(NULL), cmap_cmp_int);
+        struct avl_root root;
+        int *keys = malloc(n * sizeof(int));
+        double t, plain;
+
+        for (size_t i = 0; i < n; i++)
+            keys[i] = 2 * i;
+        shuffle(keys, n);
+        INIT_AVL_ROOT(&root);
+        for (size_t i = 0; i < n; i++) {
+            nodes[i].value = items[i].i = keys[i];
+            cmap_insert(map, &nodes[i], NULL);
+            avlitem_insert(&root, &items[i]);
+        }
+        for (size_t i = 0; i < lookups; i++)
+            queries[i] = rand() % (2 * n);
+
+        t = now();
+        for (size_t i = 0; i < lookups; i++)
+            expect[i] = cmap_find(map, &queries[i]);
+        plain = now() - t;
+        report_op("cmap find", n, lookups, plain);
+        t = now();
+        cmap_find_batch(map, queries, lookups, (node_t **) got);
+        t = now() - t;
+        report_op("cmap_find_batch", n, lookups, t);
+        printf("  speedup %.2fx\n", plain / t);
+        if (memcmp(got, expect, lookups * sizeof(void *)))
+            ret = 1;
+
+        t = now();
+        for (size_t i = 0; i < lookups; i++) {
+            struct avlitem *item = avlitem_find(&root, queries[i]);
+            expect[i] = item ? &item->avl : NULL;
+        }
+        plain = now() - t;
+        report_op("avl find", n, lookups, plain);
+        t = now();
+        avl_find_batch(&root, queries, sizeof(long), lookups, avlitem_cmp_key,
+                       (struct avl_node **) got);
+        t = now() - t;
+        report_op("avl_find_batch", n, lookups, t);
+        printf("  speedup %.2fx\n", plain / t);
+        if (memcmp(got, expect, lookups * sizeof(void *)))
+            ret = 1;
+
+        free(map);
+        free(nodes);
+        free(items);
+        free(keys);
+    }
+
+    if (ret)
+        printf("batched lookups differ\n");
+    free(queries);
+    free(expect);
+    free(got);
+    return ret;
+}
+
+/* Insert @n keys into cmap and the avl tree from the root and with the last
+ * inserted node as hint, for a monotonic stream, nearly sorted ones and a
+ * shuffled one
+ */
+static int bench_hint(size_t n)
+{
+    static const struct {
+        const char *name;
+        size_t window; /* 0 shuffles */
+    } streams[] = {
+        {"monotonic", 1},
+        {"jitter 16", 16},
+        {"jitter 1024", 1024},
+        {"random", 0},
+    };
+    int *keys = malloc(n * sizeof(int));
+    node_t *nodes = malloc(n * sizeof(*nodes));
+    struct avlitem *items = malloc(n * sizeof(*items));
+    int ret = 0;
+
+    for (size_t s = 0; s < sizeof(streams) / sizeof(streams[0]); s++) {
+        for (size_t i = 0; i < n; i++)
+            keys[i] = i;
+        if (streams[s].window)
+            jitter(keys, n, streams[s].window);
+        else
+            shuffle(keys, n);
+        printf("%s\n", streams[s].name);
+
+        for (int hint = 0; hint < 2; hint++) {
+            cmap_t map = cmap_new(sizeof(long), sizeof(NULL), cmap_cmp_int);
+            double t = now();
+            size_t count = 0;
+            int prev = -1;
+
+            for (size_t i = 0; i < n; i++) {
+                nodes[i].value = keys[i];
+                if (hint)
+                    cmap_insert_hint(map, &nodes[i], NULL);
+                else
+                    cmap_insert(map, &nodes[i], NULL);
+            }
+            report_op(hint ? "  cmap_insert_hint" : "  cmap_insert", n, n,
+                      now() - t);
+
+            for (node_t *node = cmap_first(map); node;
+                 node = cmap_next(node), count++) {
+                if (node->value <= prev)
+                    ret = 1;
+                prev = node->value;
+            }
+            if (count != n || !cmap_verify(map))
+                ret = 1;
+            free(map);
+        }
+
+        for (int hint = 0; hint < 2; hint++) {
+            struct avl_root_cached root;
+            struct avl_node *last = NULL;
+            double t;
+
+            INIT_AVL_ROOT_CACHED(&root);
+            t = now();
+            for (size_t i = 0; i < n; i++) {
+                items[i].i = keys[i];
+                if (hint) {
+                    avl_insert_hint(&items[i].avl, last, &root,
+                                    avlitem_cmp_node);
+                    last = &items[i].avl;
+                } else {
+                    avlitem_insert(&root.avl_root, &items[i]);
+                }
+            }
+            report_op(hint ? "  avl_insert_hint" : "  avl_insert", n, n,
+                      now() - t);
+
+            if (!avl_verify(&root.avl_root, avlitem_cmp_node))
+                ret = 1;
+            if (hint && (root.avl_leftmost != avl_first(&root.avl_root) ||
+                         root.avl_rightmost != avl_last(&root.avl_root)))
+                ret = 1;
+        }
+    }
+
+    if (ret)
+        printf("hinted insert produced an invalid tree\n");
+    free(keys);
+    free(nodes);
+    free(items);
+    return ret;
+}
+
+/* Reopen the map file and time the first lookup, random lookups and a full
+ * iteration, every key is checked
+ */
+static int smap_startup(const char *path, size_t n, const char *name)
+{
+    const struct smap_record *rec;
+    struct smap m;
+    char label[64];
+    size_t lookups = 100000, found = 0;
+    uint64_t seed = 88172645463325252ULL;
+    double t;
+    int ret = 0;
+
+    t = now();
+    if (smap_open(&m, path)) {
+        perror("smap_open");
+        return 1;
+    }
+    rec = smap_find(&m, 2 * (n / 2));
+    snprintf(label, sizeof(label), "%s open+find", name);
+    report_op(label, n, 1, now() - t);
+    if (m.count != n || !rec || rec->value != (int64_t) (n / 2))
+        ret = 1;
+
+    t = now();
+    for (size_t i = 0; i < lookups; i++) {
+        int64_t key;
+
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        key = seed % (2 * n);
+        rec = smap_find(&m, key);
+        if (rec ? rec->value * 2 != key : !(key & 1))
+            ret = 1;
+        found += !!rec;
+    }
+    snprintf(label, sizeof(label), "%s find", name);
+    report_op(label, n, lookups, now() - t);
+
+    t = now();
+    for (size_t i = 0; i < m.count; i++) {
+        if (m.records[i].key != (int64_t) (2 * i))
+            ret = 1;
+    }
+    snprintf(label, sizeof(label), "%s iterate", name);
+    report_op(label, n, n, now() - t);
+
+    smap_close(&m);
+    return ret || !found;
+}
+
+/* Write a map file of @n records with the keys 0, 2, 4, ... and time the
+ * startup from a cold and from a warm page cache. Rebuilding the map from the
+ * file through tree_sort is the reference, up to 10^7 records.
+ */
+static int bench_smap(size_t n, const char *path)
+{
+    FILE *out = fopen(path, "w+b");
+    struct smap_writer w;
+    int ret = 0, fd;
+    double t;
+
+    if (!out) {
+        perror(path);
+        return 1;
+    }
+    t = now();
+    if (smap_write_begin(&w, out))
+        ret = 1;
+    for (size_t i = 0; i < n && !ret; i++)
+        ret = smap_write(&w, 2 * i, i);
+    if (ret || smap_write_end(&w) || fsync(fileno(out))) {
+        perror("smap_write");
+        fclose(out);
+        return 1;
+    }
+    fclose(out);
+    t = now() - t;
+    printf("smap write %zu records %.3f s %.1f MB/s\n", n, t,
+           n * sizeof(struct smap_record) / t * 1e-6);
+
+    /* the file is clean after fsync, so the kernel can drop its pages */
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+        printf("could not drop the page cache, cold numbers are warm\n");
+    if (fd >= 0)
+        close(fd);
+    ret |= smap_startup(path, n, "cold");
+    ret |= smap_startup(path, n, "warm");
+
+    if (n <= 10000000) {
+        node_t *nodes = malloc(n * sizeof(*nodes)), *list = NULL;
+        struct smap m;
+
+        t = now();
+        if (smap_open(&m, path))
+            return 1;
+        for (size_t i = n; i--;) {
+            nodes[i].value = m.records[i].key;
+            nodes[i].next = list;
+            list = &nodes[i];
+        }
+        tree_sort(&list);
+        report_op("rebuild tree_sort", n, n, now() - t);
+        smap_close(&m);
+        free(nodes);
+    }
+
+    /* a cmap saved with cmap_save reads back the same */
+    {
+        cmap_t map = cmap_new(sizeof(long), sizeof(NULL), cmap_cmp_int);
+        size_t count = 10000;
+        node_t *nodes = malloc(count * sizeof(*nodes));
+        struct smap m;
+
+        out = fopen(path, "w+b");
+        for (size_t i = 0; i < count; i++) {
+            nodes[i].value = (int) ((i * 7919) % count) * 2;
+            cmap_insert(map, &nodes[i], NULL);
+        }
+        if (!out || cmap_save(map, out) || fclose(out) || smap_open(&m, path))
+            return 1;
+        for (size_t i = 0; i < m.count; i++) {
+            if (m.records[i].key != (int64_t) (2 * i) ||
+                smap_find(&m, 2 * i) != &m.records[i] ||
+                smap_find(&m, 2 * i + 1))
+                ret = 1;
+        }
+        if (m.count != count || smap_lower_bound(&m, -1) != 0 ||
+            smap_lower_bound(&m, 2 * count) != count)
+            ret = 1;
+        smap_close(&m);
+        free(nodes);
+        free(map);
+    }
+
+    unlink(path);
+    if (ret)
+        printf("smap lookups differ\n");
+    return ret;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/* Sort @count records of @record_size bytes with distinct keys through
+ * tree_sort_mmap in both modes, and check that every record is intact. A copy
+ * of the mapped input is the bound set by memory bandwidth, and reading bare
+ * keys into list_make_node nodes is the reference.
+ */
+static int bench_mmap_sort(size_t count, size_t record_size)
+{
+    size_t words = record_size / sizeof(int64_t), size = count * record_size;
+    int64_t *rec = malloc(record_size);
+    FILE *in = tmpfile();
+    char *src, *buf;
+    int ret = 0;
+    double t;
+
+    if (!rec || !in || !count || !words || record_size % sizeof(int64_t))
+        return 1;
+    /* every word of a record holds its key */
+    for (size_t i = 0; i < count; i++) {
+        for (size_t w = 0; w < words; w++)
+            rec[w] = (int) (uint32_t) (i * 0x9E3779B1u);
+        fwrite(rec, record_size, 1, in);
+    }
+    if (fflush(in))
+        return 1;
+
+    src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    buf = malloc(size);
+    if (src == MAP_FAILED || !buf)
+        return 1;
+    t = now();
+    memcpy(buf, src, size);
+    t = now() - t;
+    ret = memcmp(buf, src, record_size) != 0;
+    printf("mmapsort %-6s %zu records of %zu bytes %.3f s %.1f MB/s\n",
+           "memcpy", count, record_size, t, size / t * 1e-6);
+    free(buf);
+
+    for (int mode = EXT_SORT_RADIX; mode <= EXT_SORT_TREE; mode++) {
+        FILE *out = tmpfile();
+        const int64_t *dst;
+
+        t = now();
+        if (!out ||
+            tree_sort_mmap(fileno(in), fileno(out), record_size, mode)) {
+            perror("tree_sort_mmap");
+            return 1;
+        }
+        t = now() - t;
+        printf("mmapsort %-6s %zu records of %zu bytes %.3f s %.1f MB/s "
+               "peak rss %ld KiB\n",
+               mode == EXT_SORT_TREE ? "tree" : "radix", count, record_size, t,
+               size / t * 1e-6, peak_rss_kb());
+
+        dst = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(out), 0);
+        if (dst == MAP_FAILED)
+            return 1;
+        for (size_t i = 0; i < count; i++) {
+            const int64_t *r = dst + i * words;
+
+            if (i && r[0] <= r[-(ptrdiff_t) words])
+                ret = 1;
+            for (size_t w = 1; w < words; w++)
+                ret |= r[w] != r[0];
+        }
+        if (ret)
+            printf("output is not the sorted input\n");
+        munmap((void *) dst, size);
+        fclose(out);
+    }
+
+    /* a key beyond the int range is refused by EXT_SORT_TREE */
+    {
+        int64_t wide[2] = {1, (int64_t) 1 << 32};
+        FILE *f = tmpfile(), *out = tmpfile();
+
+        if (!f || !out || fwrite(wide, sizeof(wide), 1, f) != 1 || fflush(f))
+            return 1;
+        if (tree_sort_mmap(fileno(f), fileno(out), sizeof(int64_t),
+                           EXT_SORT_TREE) != -1 ||
+            errno != EINVAL) {
+            printf("tree_sort_mmap took a key beyond the int range\n");
+            ret = 1;
+        }
+        fclose(out);
+        fclose(f);
+    }
+
+    /* last, its freed nodes would be reused by the modes above */
+    if (record_size == sizeof(int64_t)) {
+        node_t *list = NULL;
+        FILE *out = tmpfile();
+
+        t = now();
+        for (size_t i = count; i--;)
+            list = list_make_node(list, ((int64_t *) src)[i]);
+        tree_sort(&list);
+        for (node_t *node = list; node; node = node->next) {
+            int64_t key = node->value;
+            fwrite(&key, sizeof(key), 1, out);
+        }
+        fflush(out);
+        t = now() - t;
+        printf("mmapsort %-6s %zu records of %zu bytes %.3f s %.1f MB/s\n",
+               "list", count, record_size, t, size / t * 1e-6);
+        list_free(&list);
+        fclose(out);
+    }
+    munmap(src, size);
+    fclose(in);
+    free(rec);
+    return ret;
+}
+
+/* Sort @count distinct records in a temporary file with @mem_mb MiB of
+ * buffers in both modes, check the output and report MB/s and peak memory
+ */
+static int bench_ext_sort(size_t count, size_t mem_mb)
+{
+    static int block[1 << 14];
+    FILE *in = tmpfile();
+    int ret = 0;
+
+    if (!in)
+        return 1;
+
+    /* i * odd constant is a permutation of the 32 bit values */
+    for (size_t i = 0; i < count;) {
+        size_t n = count - i < 1 << 14 ? count - i : 1 << 14;
+
+        for (size_t j = 0; j < n; j++, i++)
+            block[j] = (int) (uint32_t) (i * 0x9E3779B1u);
+        fwrite(block, sizeof(int), n, in);
+    }
+
+    for (int mode = EXT_SORT_RADIX; mode <= EXT_SORT_TREE; mode++) {
+        struct ext_sort_stats stats;
+        FILE *out = tmpfile();
+        size_t seen = 0, n;
+        int last = 0;
+        double t;
+
+        rewind(in);
+        t = now();
+        if (!out || tree_sort_file(in, out, mem_mb << 20, mode, &stats)) {
+            printf("tree_sort_file failed\n");
+            return 1;
+        }
+        t = now() - t;
+
+        rewind(out);
+        while ((n = fread(block, sizeof(int), 1 << 14, out)) > 0) {
+            for (size_t j = 0; j < n; j++, seen++) {
+                if (seen && block[j] <= last)
+                    ret = 1;
+                last = block[j];
+            }
+        }
+        if (ret || seen != count)
+            printf("output is not the sorted input\n");
+
+        printf("extsort %-5s %zu records %zu MiB mem: %zu runs %zu passes "
+               "%.3f s %.1f MB/s peak rss %ld KiB\n",
+               mode == EXT_SORT_TREE ? "tree" : "radix", stats.records,
+               mem_mb, stats.runs, stats.passes, t,
+               stats.records * sizeof(int) / t * 1e-6, peak_rss_kb());
+        fclose(out);
+    }
+
+    fclose(in);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    size_t count = 100;
+
+    if (argc > 1 && !strcmp(argv[1], "bench"))
+        return bench_alloc(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 20, 5);
+    if (argc > 1 && !strcmp(argv[1], "bptree"))
+        return bench_bptree(argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000);
+    if (argc > 1 && !strcmp(argv[1], "smap"))
+        return bench_smap(argc > 2 ? strtoul(argv[2], NULL, 0) : 10000000,
+                          argc > 3 ? argv[3] : "treesort.smap");
+    if (argc > 1 && !strcmp(argv[1], "findbatch"))
+        return bench_find_batch(argc > 2 ? atoi(argv[2]) : 7, 1 << 22);
+    if (argc > 1 && !strcmp(argv[1], "hint"))
+        return bench_hint(argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000);
+    if (argc > 1 && !strcmp(argv[1], "freeze"))
+        return bench_freeze(argc > 2 ? atoi(argv[2]) : 7, 1 << 22);
+    if (argc > 1 && !strcmp(argv[1], "merge"))
+        return bench_merge(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 20);
+    if (argc > 1 && !strcmp(argv[1], "mmapsort"))
+        return bench_mmap_sort(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 24,
+                               argc > 3 ? strtoul(argv[3], NULL, 0) : 8);
+    if (argc > 1 && !strcmp(argv[1], "extbench"))
+        return bench_ext_sort(argc > 2 ? strtoul(argv[2], NULL, 0) : 1 << 25,
+                              argc > 3 ? strtoul(argv[3], NULL, 0) : 16);
+    if (argc > 3 && !strcmp(argv[1], "extsort")) {
+        struct ext_sort_stats stats;
+        FILE *in = fopen(argv[2], "rb"), *out = fopen(argv[3], "wb");
+        size_t mem_mb = argc > 4 ? strtoul(argv[4], NULL, 0) : 256;
+        int ret;
+
+        if (!in || !out) {
+            perror("extsort");
+            return 1;
+        }
+        ret = tree_sort_file(in, out, mem_mb << 20, EXT_SORT_RADIX, &stats);
+        if (ret)
+            perror("extsort");
+        fclose(in);
+        fclose(out);
+        return !!ret;
+    }
 
     int *test_arr = malloc(sizeof(int) * count);
 